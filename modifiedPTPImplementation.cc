@@ -15,6 +15,15 @@
 #include <sstream>
 #include <string>
 #include <iomanip>
+#include <fstream>
+#include <deque>
+#include <map>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 
 using namespace ns3;
 
@@ -22,16 +31,229 @@ enum MSG{
   SYNC,
   FOLLOW,
   DREQ,
-  DRPLY
+  DRPLY,
+  ANNOUNCE,
+  HELLO,
+  NUM_MSG_TYPES
 };
 
+// SYNC to DRPLY, the messages of the exchange itself; ANNOUNCE and HELLO come after them
+const int NUM_EXCHANGE_TYPES = ANNOUNCE;
+
+const char * msgTypeName( int type ){
+  static const char * names[NUM_MSG_TYPES] = { "Sync", "Follow", "Dreq", "Drply", "Announce", "Hello" };
+  return names[type];
+}
+
 enum STATE{
   INACTIVE,
   ACTIVE,
   WAITING,
-  SYNCED
+  SYNCED,
+  HOLDOVER // lost the master, the clock runs on the last rate of the servo
+};
+
+
+//----------------------------------------Start Of PtpHeader Class-------------------------------------------------------
+
+// Binary layout of every protocol message (network byte order):
+//   senderId(4) receiverId(4) hop(2) msgType(1) eventId(4) dreqAtMaster(8) syncSendTime(8) correction(8)
+//   count(2) timeStamps(8 * count)
+// In transparent clock mode the timestamp list stays empty and correction carries the sum of the
+// residence times of the relays between the master and the sender.
+// An ANNOUNCE carries the best clock its sender knows: receiverId is the grandmaster's id, hop its
+// steps removed from the sender, correction its priority1 and eventId the election epoch, see
+// setGrandmaster. A HELLO of the neighbour discovery carries the sender's hop and its parent in
+// receiverId.
+// The timestamp list is kept in a vector whose capacity is reused, so a header
+// instance that lives as long as the network serializes and deserializes without allocating.
+class PtpHeader : public Header{
+public:
+  PtpHeader()
+  : senderId(0),
+    receiverId(0),
+    hop(0),
+    msgType(SYNC),
+    eventId(0),
+    dreqAtMaster(0),
+    syncSendTime(0),
+    correction(0),
+    timeStampCount(0)
+  {
+  }
+
+  static TypeId GetTypeId(){
+    static TypeId tid = TypeId ("ns3::PtpHeader")
+      .SetParent<Header> ()
+      .AddConstructor<PtpHeader> ();
+    return tid;
+  }
+
+  virtual TypeId GetInstanceTypeId() const{
+    return GetTypeId();
+  }
+
+  virtual uint32_t GetSerializedSize() const{
+    return FIXED_SIZE + 8 * timeStampCount;
+  }
+
+  virtual void Serialize( Buffer::Iterator start ) const{
+    Buffer::Iterator i = start;
+    i.WriteHtonU32( senderId );
+    i.WriteHtonU32( receiverId );
+    i.WriteHtonU16( hop );
+    i.WriteU8( msgType );
+    i.WriteHtonU32( eventId );
+    i.WriteHtonU64( dreqAtMaster );
+    i.WriteHtonU64( syncSendTime );
+    i.WriteHtonU64( correction );
+    i.WriteHtonU16( timeStampCount );
+    for( uint16_t j = 0; j < timeStampCount; j++ ){
+      i.WriteHtonU64( timeStamps[j] );
+    }
+  }
+
+  virtual uint32_t Deserialize( Buffer::Iterator start ){
+    Buffer::Iterator i = start;
+    senderId = i.ReadNtohU32();
+    receiverId = i.ReadNtohU32();
+    hop = i.ReadNtohU16();
+    msgType = i.ReadU8();
+    eventId = i.ReadNtohU32();
+    dreqAtMaster = i.ReadNtohU64();
+    syncSendTime = i.ReadNtohU64();
+    correction = i.ReadNtohU64();
+    setTimeStampCount( i.ReadNtohU16() );
+    for( uint16_t j = 0; j < timeStampCount; j++ ){
+      timeStamps[j] = i.ReadNtohU64();
+    }
+    return GetSerializedSize();
+  }
+
+  virtual void Print( std::ostream &os ) const{
+    os << "sender=" << senderId << " receiver=" << receiverId << " hop=" << hop
+       << " type=" << (uint32_t) msgType << " id=" << eventId
+       << " dreqAtMaster=" << (int64_t) dreqAtMaster << " syncSendTime=" << (int64_t) syncSendTime
+       << " correction=" << (int64_t) correction << " timeStamps=" << timeStampCount;
+  }
+
+  void setSenderId( uint32_t id ){
+    senderId = id;
+  }
+
+  uint32_t getSenderId() const{
+    return senderId;
+  }
+
+  void setReceiverId( uint32_t id ){
+    receiverId = id;
+  }
+
+  uint32_t getReceiverId() const{
+    return receiverId;
+  }
+
+  void setHop( uint16_t h ){
+    hop = h;
+  }
+
+  uint16_t getHop() const{
+    return hop;
+  }
+
+  void setMsgType( int type ){
+    msgType = type;
+  }
+
+  int getMsgType() const{
+    return msgType;
+  }
+
+  void setEventId( uint32_t id ){
+    eventId = id;
+  }
+
+  uint32_t getEventId() const{
+    return eventId;
+  }
+
+  void setDreqAtMaster( Time t ){
+    dreqAtMaster = t.GetNanoSeconds();
+  }
+
+  Time getDreqAtMaster() const{
+    return NanoSeconds( (int64_t) dreqAtMaster );
+  }
+
+  void setSyncSendTime( Time t ){
+    syncSendTime = t.GetNanoSeconds();
+  }
+
+  Time getSyncSendTime() const{
+    return NanoSeconds( (int64_t) syncSendTime );
+  }
+
+  void setCorrection( Time t ){
+    correction = t.GetNanoSeconds();
+  }
+
+  Time getCorrection() const{
+    return NanoSeconds( (int64_t) correction );
+  }
+
+  // ANNOUNCE fields, stored in receiverId and correction
+  void setGrandmaster( uint32_t id, uint8_t priority ){
+    receiverId = id;
+    correction = priority;
+  }
+
+  uint32_t getGrandmasterId() const{
+    return receiverId;
+  }
+
+  uint8_t getGrandmasterPriority() const{
+    return correction;
+  }
+
+  // resizing never releases capacity, so a reused header stops allocating once it has seen the deepest hop
+  void setTimeStampCount( uint16_t count ){
+    timeStampCount = count;
+    if( timeStamps.size() < count ){
+      timeStamps.resize( count );
+    }
+  }
+
+  uint16_t getTimeStampCount() const{
+    return timeStampCount;
+  }
+
+  void setTimeStamp( uint16_t index, Time t ){
+    timeStamps[index] = t.GetNanoSeconds();
+  }
+
+  Time getTimeStamp( uint16_t index ) const{
+    return NanoSeconds( (int64_t) timeStamps[index] );
+  }
+
+  static const uint32_t FIXED_SIZE = 41;
+
+private:
+  uint32_t senderId;
+  uint32_t receiverId;
+  uint16_t hop;
+  uint8_t msgType;
+  uint32_t eventId;
+  uint64_t dreqAtMaster;
+  uint64_t syncSendTime;
+  uint64_t correction;
+  uint16_t timeStampCount;
+  std::vector< uint64_t > timeStamps;
 };
 
+NS_OBJECT_ENSURE_REGISTERED (PtpHeader);
+
+//-------------------------------------------------X--End Of PtpHeader Class--X-----------------------------------------------
+
 
 //----------------------------------------Start Of SocketPoint Class-------------------------------------------------------
 
@@ -96,41 +318,403 @@ private:
 //-------------------------------------------------X--End Of SocketPoint Class--X-----------------------------------------------
 
 
+//-------------------------------------------------X--Start of Oscillator Classes--X------------------------------------------
+
+// Parameters of the oscillator models, see makeOscillator
+struct OscillatorParams{
+  OscillatorParams()
+  : model("constant"),
+    step(1.0),
+    walkPpb(1.0),
+    temperatureSwing(5.0),
+    temperaturePeriod(3600.0),
+    allanWhitePpb(10.0),
+    allanWalkPpb(1.0)
+  {
+  }
+
+  std::string model; // constant, randomwalk, temperature or allan
+  double step; // seconds the frequency stays constant
+  double walkPpb; // randomwalk: standard deviation of the frequency change per step
+  double temperatureSwing; // temperature: amplitude (C) of the cycle around the turnover point
+  double temperaturePeriod; // temperature: period (seconds) of the cycle
+  double allanWhitePpb; // allan: Allan deviation of white frequency noise at tau = step
+  double allanWalkPpb; // allan: Allan deviation of random walk frequency noise at tau = step
+};
+
+// Time-varying part of the frequency of one node's oscillator, in parts per billion on top of its
+// constant skew. The frequency is constant over each step. Samples are generated a block at a time
+// and only when the node's clock is read past the end of the current step, so nodes whose clock is
+// not looked at cost nothing.
+class OscillatorModel{
+public:
+  OscillatorModel( Time stepLength )
+  : step(stepLength),
+    next(BLOCK)
+  {
+  }
+
+  virtual ~OscillatorModel(){
+  }
+
+  Time getStep() const{
+    return step;
+  }
+
+  // frequency deviation during the next step
+  int64_t nextSample(){
+    if( next == BLOCK ){
+      fillBlock( block, BLOCK );
+      next = 0;
+    }
+    return block[ next++ ];
+  }
+
+  virtual size_t getMemoryUsage() const = 0;
+
+protected:
+  static const uint32_t BLOCK = 32;
+
+  // writes the deviations of the next count steps
+  virtual void fillBlock( int64_t *samples, uint32_t count ) = 0;
+
+private:
+  Time step;
+  uint32_t next;
+  int64_t block[BLOCK];
+};
+
+const uint32_t OscillatorModel::BLOCK;
+
+// Frequency doing a random walk: every step adds a normal change of sigmaPpb
+class RandomWalkOscillator : public OscillatorModel{
+public:
+  RandomWalkOscillator( Time stepLength, double sigmaPpb, uint32_t seed )
+  : OscillatorModel( stepLength ),
+    rng( seed ),
+    change( 0, sigmaPpb ),
+    walk(0)
+  {
+  }
+
+  virtual size_t getMemoryUsage() const{
+    return sizeof( *this );
+  }
+
+protected:
+  virtual void fillBlock( int64_t *samples, uint32_t count ){
+    for( uint32_t j = 0; j < count; j++ ){
+      walk += change( rng );
+      samples[j] = std::llround( walk );
+    }
+  }
+
+  // a small generator on purpose: thousands of nodes each keep one
+  std::minstd_rand rng;
+
+private:
+  std::normal_distribution< double > change;
+  double walk;
+};
+
+// Frequency following the temperature: a sinusoidal cycle of +-swing degrees around the turnover
+// point of a quartz crystal, whose frequency falls off with the square of the distance to it
+// (-0.034 ppm/C^2). Every node starts at a random phase of the cycle.
+class TemperatureOscillator : public OscillatorModel{
+public:
+  TemperatureOscillator( Time stepLength, double swing, double period, uint32_t seed )
+  : OscillatorModel( stepLength ),
+    swing(swing),
+    stepPhase( 2 * M_PI * stepLength.GetSeconds() / period ),
+    phase( 2 * M_PI * ( seed % 3600 ) / 3600.0 )
+  {
+  }
+
+  virtual size_t getMemoryUsage() const{
+    return sizeof( *this );
+  }
+
+protected:
+  virtual void fillBlock( int64_t *samples, uint32_t count ){
+    for( uint32_t j = 0; j < count; j++ ){
+      double delta = swing * std::sin( phase );
+      samples[j] = std::llround( -34.0 * delta * delta );
+      phase += stepPhase;
+    }
+  }
+
+private:
+  double swing;
+  double stepPhase;
+  double phase;
+};
+
+// White plus random walk frequency noise calibrated by their Allan deviations at tau = step. For
+// white noise the Allan deviation at the sampling interval is the deviation of the samples; for a
+// random walk held constant over each step it is the deviation of the changes divided by sqrt(2).
+class AllanOscillator : public RandomWalkOscillator{
+public:
+  AllanOscillator( Time stepLength, double whitePpb, double walkPpb, uint32_t seed )
+  : RandomWalkOscillator( stepLength, std::sqrt( 2.0 ) * walkPpb, seed ),
+    white( 0, whitePpb )
+  {
+  }
+
+  virtual size_t getMemoryUsage() const{
+    return sizeof( *this );
+  }
+
+protected:
+  virtual void fillBlock( int64_t *samples, uint32_t count ){
+    RandomWalkOscillator::fillBlock( samples, count );
+    for( uint32_t j = 0; j < count; j++ ){
+      samples[j] += std::llround( white( rng ) );
+    }
+  }
+
+private:
+  std::normal_distribution< double > white;
+};
+
+// A new model for one node as described by params, 0 for the constant skew every node has anyway
+OscillatorModel * makeOscillator( const OscillatorParams &params ){
+  Time step = Seconds( params.step );
+  if( params.model == "randomwalk" ){
+    return new RandomWalkOscillator( step, params.walkPpb, rand() );
+  }else if( params.model == "temperature" ){
+    return new TemperatureOscillator( step, params.temperatureSwing, params.temperaturePeriod, rand() );
+  }else if( params.model == "allan" ){
+    return new AllanOscillator( step, params.allanWhitePpb, params.allanWalkPpb, rand() );
+  }
+  return 0;
+}
+
+bool isOscillatorModel( const std::string &model ){
+  return model == "constant" || model == "randomwalk" || model == "temperature" || model == "allan";
+}
+
+//-------------------------------------------------X--End of Oscillator Classes--X------------------------------------------
+
+
 //----------------------------------------------------Start Of WirelessNode Class-----------------------------------------------
-using namespace ns3;
+
+// fixed-size values in the byte order of this machine, for the snapshot files
+template< class T >
+void writeRaw( std::ostream &os, const T &value ){
+  os.write( reinterpret_cast< const char * >( &value ), sizeof( T ) );
+}
+
+template< class T >
+bool readRaw( std::istream &in, T &value ){
+  return (bool) in.read( reinterpret_cast< char * >( &value ), sizeof( T ) );
+}
+
+// Protocol state of one node at the end of a run, see WirelessNode::getSnapshot. Times are in
+// local clock nanoseconds; the clock itself is kept as its offset to the master's so that it can
+// be restored at any simulator time.
+struct NodeSnapshot{
+  uint32_t masterId;
+  uint16_t hop;
+  uint8_t state;
+  int64_t clockOffset; // local minus master clock
+  int64_t sinceCorrection; // local time since the last correction
+  int64_t frequencyPpb;
+  int64_t wanderPpb;
+  double rateAdjust;
+  double servoIntegral;
+  int32_t numCorrections;
+  int64_t offset;
+  int64_t syncSendTime;
+  int64_t dreqAtMaster;
+  int64_t upstreamCorrection;
+  std::vector< int64_t > timeStamps;
+  uint32_t sentPacket[NUM_MSG_TYPES];
+  uint32_t receivedPacket[NUM_MSG_TYPES];
+  uint32_t overheardPacket[NUM_MSG_TYPES];
+  uint64_t sentBytes[NUM_MSG_TYPES];
+  int64_t airtime[NUM_MSG_TYPES];
+
+  void write( std::ostream &os ) const{
+    writeRaw( os, masterId );
+    writeRaw( os, hop );
+    writeRaw( os, state );
+    writeRaw( os, clockOffset );
+    writeRaw( os, sinceCorrection );
+    writeRaw( os, frequencyPpb );
+    writeRaw( os, wanderPpb );
+    writeRaw( os, rateAdjust );
+    writeRaw( os, servoIntegral );
+    writeRaw( os, numCorrections );
+    writeRaw( os, offset );
+    writeRaw( os, syncSendTime );
+    writeRaw( os, dreqAtMaster );
+    writeRaw( os, upstreamCorrection );
+    writeRaw( os, (uint32_t) timeStamps.size() );
+    for( uint32_t j = 0; j < timeStamps.size(); j++ ){
+      writeRaw( os, timeStamps[j] );
+    }
+    for( int m = 0; m < NUM_MSG_TYPES; m++ ){
+      writeRaw( os, sentPacket[m] );
+      writeRaw( os, receivedPacket[m] );
+      writeRaw( os, overheardPacket[m] );
+      writeRaw( os, sentBytes[m] );
+      writeRaw( os, airtime[m] );
+    }
+  }
+
+  bool read( std::istream &in ){
+    uint32_t count = 0;
+    bool ok = readRaw( in, masterId ) && readRaw( in, hop ) && readRaw( in, state ) && readRaw( in, clockOffset )
+      && readRaw( in, sinceCorrection ) && readRaw( in, frequencyPpb ) && readRaw( in, wanderPpb )
+      && readRaw( in, rateAdjust ) && readRaw( in, servoIntegral ) && readRaw( in, numCorrections )
+      && readRaw( in, offset ) && readRaw( in, syncSendTime ) && readRaw( in, dreqAtMaster )
+      && readRaw( in, upstreamCorrection ) && readRaw( in, count );
+    // a hop count is below 2^16, so is the number of timestamps of a sane file
+    if( !ok || count > 3 * 0x10000u ){
+      return false;
+    }
+    timeStamps.assign( count, 0 );
+    for( uint32_t j = 0; ok && j < count; j++ ){
+      ok = readRaw( in, timeStamps[j] );
+    }
+    for( int m = 0; ok && m < NUM_MSG_TYPES; m++ ){
+      ok = readRaw( in, sentPacket[m] ) && readRaw( in, receivedPacket[m] ) && readRaw( in, overheardPacket[m] )
+        && readRaw( in, sentBytes[m] ) && readRaw( in, airtime[m] );
+    }
+    return ok;
+  }
+};
+
+// Servo state, only kept for a node whose clock is slewed, see WirelessNode::setServo
+struct NodeServo{
+  NodeServo()
+  : enabled(false),
+    kp(0),
+    ki(0),
+    integral(0),
+    rateAdjust(1),
+    lastCorrectionTime(0)
+  {
+  }
+
+  bool enabled;
+  double kp;
+  double ki;
+  double integral;
+  double rateAdjust; // multiplies the clock rate
+  Time lastCorrectionTime; // local time of the previous correction
+};
+
+// Statistics that only the reports, the trace, snapshots and the steady-state accuracy read,
+// only kept when WirelessNetwork::SetNodeStatistics asks for them
+struct NodeStatistics{
+  NodeStatistics()
+  : oldOffsetError(0),
+    newOffsetError(0),
+    accuracySum(0),
+    accuracySquareSum(0),
+    accuracyMax(0),
+    accuracySamples(0)
+  {
+    for( int j=0; j < NUM_MSG_TYPES; j++){
+      overheardPacket[j] = 0;
+      sentBytes[j] = 0;
+      airtime[j] = 0;
+    }
+    for( int j=0; j < NUM_MSG_TYPES - NUM_EXCHANGE_TYPES; j++){
+      controlSent[j] = 0;
+      controlReceived[j] = 0;
+    }
+  }
+
+  double oldOffsetError;
+  double newOffsetError;
+  double accuracySum;
+  double accuracySquareSum;
+  double accuracyMax;
+  int accuracySamples;
+  uint32_t controlSent[NUM_MSG_TYPES - NUM_EXCHANGE_TYPES]; // ANNOUNCE and HELLO
+  uint32_t controlReceived[NUM_MSG_TYPES - NUM_EXCHANGE_TYPES];
+  uint32_t overheardPacket[NUM_MSG_TYPES]; // num of packets overheard and ignored
+  uint64_t sentBytes[NUM_MSG_TYPES]; // UDP payload bytes of every transmission
+  int64_t airtime[NUM_MSG_TYPES]; // nanoseconds of channel time of every transmission
+};
+
+// The part of a node that is not read on every clock access: the exchange in progress, the rest of
+// the rate and the counters of the exchange. Records are kept apart from the nodes, see
+// ScenarioArena, so that the WirelessNode objects every event walks over stay small. The servo and
+// the statistics are only allocated when they are used.
+struct NodeRecord{
+  NodeRecord( Ipv4Address ipv4Address )
+  : syncSendTime(0),
+    dreqAtMaster(0),
+    upstreamCorrection(0),
+    offset(0),
+    frequencyPpb(0),
+    wanderPpb(0),
+    stepEnd(0),
+    oscillator(0),
+    syncStartTime(0),
+    synchronizationTime(0),
+    numCorrections(0),
+    node_ipv4Address(ipv4Address),
+    transparentClock(false)
+  {
+    for( int j=0; j < NUM_EXCHANGE_TYPES; j++){
+      sentPacket[j] = 0;
+      receivedPacket[j] = 0;
+    }
+  }
+
+  // the exchange in progress
+  Time syncSendTime;
+  Time dreqAtMaster;
+  Time upstreamCorrection; // residence times of the relays between the master and this node
+  Time offset;
+  std::vector< Time > timeStamps;
+  std::vector< int > neighbourIndex; // index to their sockets in the list storing all the sockets of networks
+
+  // the terms of the rate, only read when it changes
+  int64_t frequencyPpb; // constant error of the oscillator in parts per billion
+  int64_t wanderPpb; // deviation from it in the current step of the oscillator model
+  Time stepEnd; // simulator time the current step of the oscillator model ends
+  OscillatorModel *oscillator; // 0 for a constant skew
+
+  Time syncStartTime;
+  Time synchronizationTime;
+  std::unique_ptr< NodeServo > servo; // 0 while every offset is stepped out
+  std::unique_ptr< NodeStatistics > statistics; // 0 unless asked for
+  int numCorrections;
+  const Ipv4Address node_ipv4Address;
+  bool transparentClock;
+  uint32_t sentPacket[NUM_EXCHANGE_TYPES]; // indexed by packet type(Sync, Follow, Dreq, Drply), num of packets sent out
+  uint32_t receivedPacket[NUM_EXCHANGE_TYPES]; // num of packets received
+};
 
 class WirelessNode{
 public:
+  // the cold state of the node is kept in record, owned by whoever creates the node
   WirelessNode(
-  const uint16_t id,
-  const uint16_t master_id,
+  const uint32_t id,
+  const uint32_t master_id,
   const uint16_t hop,
-  const Ipv4Address ipv4Address
+  NodeRecord *nodeRecord
   )
-  : node_id(id),
+  : localTime(0),
+    simulatorTime(0),
+    record(nodeRecord),
+    node_id(id),
     masterId(master_id),
-    hop_num(hop),
-    node_ipv4Address(ipv4Address)
+    hop_num(hop)
     {
-    // Add some packet information
     nodeState = 0; // 0 - inactive, 1 - active, 2 - waiting( to send Dreq), 3 - Sync
-    clockError = ( rand() % 6 ) * 0.012 * hop_num + 0.998;
-    oldOffsetError = 0;
-    newOffsetError = 0;
-    isMaster = 0;
-    syncSendTime = NanoSeconds (0);
-    dreqAtMaster = NanoSeconds (0);
-    
-      for( int j=0; j < 3 * hop; j++ ){
-        timeStamps.push_back( NanoSeconds (0) );
-      }
-
-      for( int j=0; j < 4; j++){
-        sentPacket.push_back(0);
-        receivedPacket.push_back(0);
-        overheardPacket.push_back(0);
-      }
-    }
+    isMaster = false;
+    lazyClock = true;
+    oscillating = false;
+    record->frequencyPpb = ( rand() % 6 ) * 12000000LL * hop_num - 2000000;
+    ratePpb = PPB + record->frequencyPpb;
+    record->timeStamps.assign( 3 * hop, NanoSeconds (0) );
+  }
 
   void setState(int i){
     nodeState = i;
@@ -140,123 +724,268 @@ public:
     return nodeState;
   }
 
-  void setNodeAsMaster(){
-    isMaster = 1;
-    clockError = 1;
+  // the master's clock is the reference, its own oscillator is not used while it is master
+  void setNodeAsMaster( bool master = true ){
+    isMaster = master;
+  }
+
+  // moves the node to the place the election gave it in the sync tree
+  void setSyncTree( uint32_t parentId, uint16_t hop ){
+    masterId = parentId;
+    hop_num = hop;
+    record->timeStamps.assign( record->transparentClock ? 3 : 3 * hop, NanoSeconds (0) );
   }
 
   // called once to set the local time
   void setIntialTime( Time initialtime ){
     localTime = NanoSeconds ( 0 );
     simulatorTime = initialtime;
+    record->stepEnd = initialtime;
+  }
+
+  // lets the frequency wander as the model says, on top of the constant skew
+  void setOscillator( OscillatorModel *model ){
+    record->oscillator = model;
+    record->stepEnd = simulatorTime;
+    oscillating = model != 0;
+  }
+
+  // Eager mode reproduces the per-event sweep: the clock is only advanced by setLocalTime, called on
+  // every event, and getLocalTime returns the value of the last sweep. Lazy clocks are extrapolated
+  // to the current time wherever they are read. Every sweep truncates the elapsed simulator time to
+  // a whole tick and its product with the rate to a whole nanosecond, so an eager clock falls behind
+  // the lazy one by about 0.9 ns per event: 0.90 ns per event over 10^2 to 10^6 events at 1 us to
+  // 2 ms apart, for rates from -2 to +118 ppm. Send timestamps differ further, because an eager
+  // clock read by a send reports the last sweep, not the send time.
+  void setLazyClock( bool lazy ){
+    lazyClock = lazy;
   }
 
-  // called after happening of any event in the network
+  // anchors the clock at currentSimulatorTime; with lazy clocks it is only called when the clock is stepped
   void setLocalTime( Time currentSimulatorTime ){
-    int newTime;
+    localTime = this->localTimeAt( currentSimulatorTime );
+    simulatorTime = currentSimulatorTime;
+  }
+
+  // value of the local clock at currentSimulatorTime, extrapolated from the last anchor. The clock
+  // ticks once per 5 ns of simulator time and runs at ratePpb parts per billion of that, so the whole
+  // computation stays in 64-bit integers and gives the same nanosecond however long the run is.
+  Time localTimeAt( Time currentSimulatorTime ){
+    int64_t newTime;
     if( !isMaster ){
-      localTime = NanoSeconds((currentSimulatorTime.GetNanoSeconds () - this->getSimulatorTime().GetNanoSeconds ()) / 5 * clockError 
-                            + localTime.GetNanoSeconds());
-      this->setSimulatorTime( currentSimulatorTime );
+      if( oscillating ){
+        this->advanceOscillator( currentSimulatorTime );
+      }
+      newTime = ( currentSimulatorTime.GetNanoSeconds () - this->getSimulatorTime().GetNanoSeconds () ) / 5;
+      return NanoSeconds( (int64_t) ( scaleByRate( newTime, ratePpb ) + localTime.GetNanoSeconds() ) );
     }else{
-      simulatorTime = currentSimulatorTime;
       newTime = currentSimulatorTime.GetNanoSeconds() / 5;
-      localTime = NanoSeconds(newTime);
+      return NanoSeconds(newTime);
+    }
+  }
+
+  // ticks * rate / 10^9 without overflow: the ticks are split into whole seconds and the rest,
+  // whose product with the rate stays below 2^63 for any rate under 9.2 (a ppb term below 8.2e9)
+  static int64_t scaleByRate( int64_t ticks, int64_t rate ){
+    int64_t seconds = ticks / PPB;
+    int64_t rest = ticks % PPB;
+    return seconds * rate + rest * rate / PPB;
+  }
+
+  // Moves the anchor over the steps of the oscillator that ended before currentSimulatorTime, each
+  // at its own rate, and takes the frequency of the step that is running then. Reads earlier than
+  // the anchor extrapolate backwards at the current rate.
+  void advanceOscillator( Time currentSimulatorTime ){
+    while( currentSimulatorTime >= record->stepEnd ){
+      localTime += NanoSeconds( (int64_t) scaleByRate( ( record->stepEnd - simulatorTime ).GetNanoSeconds() / 5, ratePpb ) );
+      simulatorTime = record->stepEnd;
+      record->stepEnd += record->oscillator->getStep();
+      record->wanderPpb = record->oscillator->nextSample();
+      this->updateRate();
+    }
+  }
+
+  void updateRate(){
+    ratePpb = std::llround( ( PPB + record->frequencyPpb + record->wanderPpb ) * this->getRateAdjust() );
+  }
+
+  // Transparent clock mode: instead of the timestamps of every hop the node keeps only its own
+  // three and the correction accumulated by the relays above it, so memory, message size and
+  // calculateOffset no longer grow with the hop number.
+  void setTransparentClock(){
+    record->transparentClock = true;
+    record->timeStamps.assign( 3, NanoSeconds (0) );
+  }
+
+  // residence time of this node added to the correction it received: what it forwards downstream
+  Time getDownstreamCorrection(){
+    if( hop_num == 0 ){
+      return NanoSeconds (0);
     }
+    return record->upstreamCorrection + record->timeStamps[0] - record->timeStamps[1];
   }
 
-  void copyTimeVector(Time dreqRecvMaster, Time syncSend, std::vector<Time> timeVector){
-    dreqAtMaster = dreqRecvMaster;
-    syncSendTime = syncSend;
-    for( int i=0; i < timeVector.size(); i++){
-      timeStamps[i] = timeVector[i];
+  void copyTimeVector(const PtpHeader &header){
+    record->dreqAtMaster = header.getDreqAtMaster();
+    record->syncSendTime = header.getSyncSendTime();
+    record->upstreamCorrection = header.getCorrection();
+    for( int i=0; i < header.getTimeStampCount(); i++){
+      record->timeStamps[i] = header.getTimeStamp(i);
     }
   }
 
   void addTimeStamp( Time t, int i, int j){
-    int index = 3*(i-1) + j;
-    timeStamps[ index ] = NanoSeconds ( t.GetNanoSeconds () );
+    int index = record->transparentClock ? j : 3*(i-1) + j;
+    record->timeStamps[ index ] = NanoSeconds ( t.GetNanoSeconds () );
   }
 
   void calculateOffset(){
-    int clockOffset;
+    int64_t clockOffset;
     if( !isMaster ){
       Time temp = NanoSeconds (0);
       int i,j;
-      if( hop_num > 1 ){
-        temp = NanoSeconds ( timeStamps[3*(hop_num-1)].GetNanoSeconds() + timeStamps[3*(hop_num-1)+2].GetNanoSeconds() );
+      if( hop_num > 1 && record->transparentClock ){
+        // the correction holds the sum of (timeStamps[3*(i-1)] - timeStamps[3*(i-1)+1]) over the relays
+        temp = record->timeStamps[0] + record->timeStamps[2] + record->upstreamCorrection;
+        temp = temp - NanoSeconds ( record->syncSendTime.GetNanoSeconds() + record->dreqAtMaster.GetNanoSeconds() );
+        clockOffset = temp.GetNanoSeconds() / 2;
+        record->offset =  NanoSeconds(clockOffset) ;
+
+      }else if( hop_num > 1 ){
+        temp = NanoSeconds ( record->timeStamps[3*(hop_num-1)].GetNanoSeconds() + record->timeStamps[3*(hop_num-1)+2].GetNanoSeconds() );
         for( i=1;i <= hop_num-1;i++){
-          temp = temp + NanoSeconds ( timeStamps[3*(i-1)].GetNanoSeconds() - timeStamps[3*(i-1)+1].GetNanoSeconds() );
+          temp = temp + NanoSeconds ( record->timeStamps[3*(i-1)].GetNanoSeconds() - record->timeStamps[3*(i-1)+1].GetNanoSeconds() );
           j = 3*(i-1);
         }
-        temp = temp - NanoSeconds ( syncSendTime.GetNanoSeconds() + dreqAtMaster.GetNanoSeconds() );
+        temp = temp - NanoSeconds ( record->syncSendTime.GetNanoSeconds() + record->dreqAtMaster.GetNanoSeconds() );
         clockOffset = temp.GetNanoSeconds() / 2;
-        offset =  NanoSeconds(clockOffset) ;
+        record->offset =  NanoSeconds(clockOffset) ;
 
       }else{
-        temp = NanoSeconds((timeStamps[0].GetNanoSeconds() - syncSendTime.GetNanoSeconds()) - 
-             (dreqAtMaster.GetNanoSeconds() - timeStamps[2].GetNanoSeconds()));
+        temp = NanoSeconds((record->timeStamps[0].GetNanoSeconds() - record->syncSendTime.GetNanoSeconds()) - 
+             (record->dreqAtMaster.GetNanoSeconds() - record->timeStamps[2].GetNanoSeconds()));
         clockOffset = temp.GetNanoSeconds() / 2;
-        offset =  NanoSeconds(clockOffset) ;
+        record->offset =  NanoSeconds(clockOffset) ;
       }
     }
   }
 
+  // keeps the statistics of the node from now on, see NodeStatistics
+  void enableStatistics(){
+    if( !record->statistics ){
+      record->statistics.reset( new NodeStatistics() );
+    }
+  }
+
   void setOldOffsetError(Time masterTime){
-    oldOffsetError = std::abs((this->getLocalTime().GetNanoSeconds() - masterTime.GetNanoSeconds ())) * 1.0 / masterTime.GetNanoSeconds() ;
+    if( record->statistics ){
+      record->statistics->oldOffsetError = std::abs((this->getLocalTime().GetNanoSeconds() - masterTime.GetNanoSeconds ())) * 1.0 / masterTime.GetNanoSeconds() ;
+    }
   }
 
   double getOldOffsetError(){
-    return oldOffsetError;
+    return record->statistics ? record->statistics->oldOffsetError : 0;
   }
 
   void setNewOffsetError(Time masterTime){
-    this->localTime -= offset;
-    newOffsetError = std::abs((this->getLocalTime().GetNanoSeconds() - masterTime.GetNanoSeconds ())) * 1.0 / masterTime.GetNanoSeconds () ;
+    this->correctClock();
+    if( record->statistics ){
+      record->statistics->newOffsetError = std::abs((this->getLocalTime().GetNanoSeconds() - masterTime.GetNanoSeconds ())) * 1.0 / masterTime.GetNanoSeconds () ;
+    }
   }
 
   double getNewOffsetError(){
-    return newOffsetError;
+    return record->statistics ? record->statistics->newOffsetError : 0;
   }
 
-  void addChildDreqTime(int childId, Time dreqTime){
-    long long childTime = dreqTime.GetNanoSeconds ();
-    childDreqTime.insert( std::pair< int , long long >(childId, childTime) );
+  // PI servo gains; with the servo disabled every measured offset is stepped out of the clock
+  void setServo( bool enabled, double kp, double ki ){
+    if( enabled && !record->servo ){
+      record->servo.reset( new NodeServo() );
+    }
+    if( record->servo ){
+      record->servo->enabled = enabled;
+      record->servo->kp = kp;
+      record->servo->ki = ki;
+    }
   }
 
-  Time getChildDreqTime(int childId ){
-    Time dreqTime;
-    std::map< int, long long >::iterator it;
-    it = childDreqTime.find(childId);
-      dreqTime = NanoSeconds ( it->second );
-      return dreqTime;
+  // Removes the measured offset. The first measurement steps the clock. With the servo enabled
+  // later ones slew it: the offset over the time since the previous correction is the frequency
+  // error seen in that interval, and the PI output becomes the new rate adjustment. The integral
+  // term converges to the frequency error of the oscillator.
+  void correctClock(){
+    if( lazyClock ){
+      this->setLocalTime( Simulator::Now() );
+    }
+    NodeServo *servo = record->servo.get();
+    double interval = servo != 0 ? ( localTime - servo->lastCorrectionTime ).GetNanoSeconds() : 0;
+    if( servo == 0 || !servo->enabled || record->numCorrections == 0 || interval <= 0 ){
+      localTime -= record->offset;
+    }else{
+      double error = record->offset.GetNanoSeconds() / interval;
+      servo->integral += servo->ki * error;
+      servo->rateAdjust = 1 - ( servo->kp * error + servo->integral );
+      this->updateRate();
+    }
+    if( servo != 0 ){
+      servo->lastCorrectionTime = localTime;
+    }
+    record->numCorrections++;
   }
 
-  void addDreqSendTime(int nodeId, Time dreqTime){
-    long long childTime = dreqTime.GetNanoSeconds ();
-    dreqSendTime.insert( std::pair< int , long long >( nodeId, childTime) );
+  int getNumCorrections(){
+    return record->numCorrections;
   }
 
-  Time getDreqSendTime(int nodeId ){
-    Time dreqTime;
-    std::map< int, long long >::iterator it;
-    it = childDreqTime.find(nodeId);
-      dreqTime = NanoSeconds ( it->second );
-      return dreqTime;
+  // fractional frequency error the servo has estimated for this clock
+  double getEstimatedFrequencyError(){
+    return record->servo ? record->servo->integral : 0;
   }
 
-  void addDrplyRequest(int id){
-    sendDrply.push_back(id);
+  double getRateAdjust(){
+    return record->servo ? record->servo->rateAdjust : 1;
   }
 
-  int getDrplyId(){
-    if( sendDrply.size() != 0 ){
-      int id = sendDrply[0];
-      sendDrply.erase (sendDrply.begin());
-      return id;
-    }else{
-      return -1;
+  // Records the true offset to the master just before a correction. The first
+  // ACCURACY_WARMUP corrections are the servo locking in and are not counted.
+  void addAccuracySample( Time masterTime ){
+    NodeStatistics *statistics = record->statistics.get();
+    if( statistics == 0 || record->numCorrections < ACCURACY_WARMUP ){
+      return;
     }
+    double error = std::abs( (double)( this->getLocalTime().GetNanoSeconds() - masterTime.GetNanoSeconds() ) );
+    statistics->accuracySamples++;
+    statistics->accuracySum += error;
+    statistics->accuracySquareSum += error * error;
+    statistics->accuracyMax = std::max( statistics->accuracyMax, error );
+  }
+
+  int getAccuracySamples(){
+    return record->statistics ? record->statistics->accuracySamples : 0;
+  }
+
+  double getMeanAbsoluteError(){
+    int samples = this->getAccuracySamples();
+    return samples ? record->statistics->accuracySum / samples : 0;
+  }
+
+  double getRmsError(){
+    int samples = this->getAccuracySamples();
+    return samples ? std::sqrt( record->statistics->accuracySquareSum / samples ) : 0;
+  }
+
+  double getMaxAbsoluteError(){
+    return record->statistics ? record->statistics->accuracyMax : 0;
+  }
+
+  static const int ACCURACY_WARMUP = 2;
+
+  // bytes of node state: the object itself, its record and the heap storage they own
+  size_t getMemoryUsage(){
+    return sizeof( *this ) + sizeof( NodeRecord ) + record->timeStamps.capacity() * sizeof( Time ) + record->neighbourIndex.capacity() * sizeof( int )
+      + ( record->servo ? sizeof( NodeServo ) : 0 ) + ( record->statistics ? sizeof( NodeStatistics ) : 0 )
+      + ( record->oscillator != 0 ? record->oscillator->getMemoryUsage() : 0 );
   }
 
   uint32_t getMasterId(){
@@ -264,11 +993,11 @@ public:
   }
 
   Time getOffset(){
-    return offset;
+    return record->offset;
   }
 
   Time getLocalTime(){
-    return this->localTime;
+    return lazyClock ? this->localTimeAt( Simulator::Now() ) : localTime;
   }
 
   void setSimulatorTime( Time currentTime ){
@@ -276,45 +1005,41 @@ public:
   }
 
   void setSyncSendTime(Time sendTime){
-    syncSendTime = sendTime;
+    record->syncSendTime = sendTime;
   }
 
   void setDreqAtMaster(Time dreqTime){
-    dreqAtMaster = dreqTime;
+    record->dreqAtMaster = dreqTime;
   }
 
   void setSyncStartTime(Time currentTime){
-    int newTime = currentTime.GetNanoSeconds() / 5;
-    syncStartTime = NanoSeconds(newTime);
+    int64_t newTime = currentTime.GetNanoSeconds() / 5;
+    record->syncStartTime = NanoSeconds(newTime);
   }
 
+  // the exchange ends: its synchronization time is the time since setSyncStartTime
   void setSyncEndTime(Time currentTime){
-    int newTime = currentTime.GetNanoSeconds() / 5;
-    syncEndTime = NanoSeconds(newTime);
-  }
-
-  void setSynchronizationTime(){
-    std::cout << " syncEndTime = " << syncEndTime.GetNanoSeconds() << "   syncStartTime = " << syncStartTime.GetNanoSeconds() << std::endl;
-    synchronizationTime = syncEndTime - syncStartTime;
+    int64_t newTime = currentTime.GetNanoSeconds() / 5;
+    record->synchronizationTime = NanoSeconds(newTime) - record->syncStartTime;
   }
 
   Time getSynchronizationTime(){
-    return synchronizationTime;
+    return record->synchronizationTime;
   }
 
   Time getSyncSendTime(){
-    return syncSendTime;
+    return record->syncSendTime;
   }
 
   Time getDreqAtMaster(){
-    return dreqAtMaster;
+    return record->dreqAtMaster;
   }
 
   Time getSimulatorTime(){
     return simulatorTime;
   }
 
-  uint16_t getNodeId(){
+  uint32_t getNodeId(){
     return node_id;
   }
 
@@ -327,112 +1052,1161 @@ public:
   }
 
   Ipv4Address getIpv4Address(){
-    return node_ipv4Address;
+    return record->node_ipv4Address;
   }
 
   uint16_t getNumNeighbour(){
-    return neighbourIndex.size();
+    return record->neighbourIndex.size();
   }
 
   void addNeighbourIndex(int index){
-    neighbourIndex.push_back(index);
+    record->neighbourIndex.push_back(index);
   }
 
   int getNeighbour(int index){
-    return neighbourIndex[index];
+    return record->neighbourIndex[index];
   }
 
+  // the messages of the exchange are always counted, ANNOUNCE and HELLO only with the statistics
   void incrementSentPacketCounter(int type){
-    sentPacket[type]++;
+    if( type < NUM_EXCHANGE_TYPES ){
+      record->sentPacket[type]++;
+    }else if( record->statistics ){
+      record->statistics->controlSent[type - NUM_EXCHANGE_TYPES]++;
+    }
   }
 
   void incrementReceivedPacketCounter(int type){
-    receivedPacket[type]++;
+    if( type < NUM_EXCHANGE_TYPES ){
+      record->receivedPacket[type]++;
+    }else if( record->statistics ){
+      record->statistics->controlReceived[type - NUM_EXCHANGE_TYPES]++;
+    }
   }
 
   void incrementOverheardPacketCounter(int type){
-    overheardPacket[type]++;
+    if( record->statistics ){
+      record->statistics->overheardPacket[type]++;
+    }
   } 
 
   int getSentPacketCounter(int type){
-    return sentPacket[type];
+    if( type < NUM_EXCHANGE_TYPES ){
+      return record->sentPacket[type];
+    }
+    return record->statistics ? record->statistics->controlSent[type - NUM_EXCHANGE_TYPES] : 0;
   }
 
   int getReceivedPacketCounter(int type){
-    return receivedPacket[type];
+    if( type < NUM_EXCHANGE_TYPES ){
+      return record->receivedPacket[type];
+    }
+    return record->statistics ? record->statistics->controlReceived[type - NUM_EXCHANGE_TYPES] : 0;
   }
 
   int getOverheardPacketCounter(int type){
-    return overheardPacket[type];
+    return record->statistics ? record->statistics->overheardPacket[type] : 0;
   }
 
-
-  int getTimeVectorSize(){
-    return timeStamps.size();
+  // one transmission of a message of the given type: its UDP payload size and channel time
+  void addTransmission(int type, uint32_t bytes, Time duration){
+    if( record->statistics ){
+      record->statistics->sentBytes[type] += bytes;
+      record->statistics->airtime[type] += duration.GetNanoSeconds();
+    }
   }
 
-  Time getTimeStamp(int index){
-    return timeStamps[index];
+  uint64_t getSentBytes(int type){
+    return record->statistics ? record->statistics->sentBytes[type] : 0;
   }
 
-  void setWaitingTime(){
-    waitingTime = NanoSeconds ( std::abs( timeStamps[0].GetNanoSeconds () - syncSendTime.GetNanoSeconds () ) );
+  Time getAirtime(int type){
+    return NanoSeconds( record->statistics ? record->statistics->airtime[type] : 0 );
   }
 
-  Time getWaitingTime(){
-    return waitingTime;
-  } 
 
-  void setReplyId(int x){
-    replyId = x;
+  int getTimeVectorSize(){
+    return record->timeStamps.size();
   }
 
-  int getReplyId(){
-    return replyId;
+  Time getTimeStamp(int index){
+    return record->timeStamps[index];
   }
-  
+
+  // rate of the free-running oscillator relative to the master, 1 for a perfect clock
   double getError(){
-    return clockError;
+    if( isMaster ){
+      return 1;
+    }
+    return 1 + ( record->frequencyPpb + record->wanderPpb ) * 1e-9;
+  }
+
+  int64_t getFrequencyPpb(){
+    return record->frequencyPpb;
+  }
+
+  // the rate the clock runs at now, oscillator and servo together
+  int64_t getRatePpb(){
+    return ratePpb;
+  }
+
+  NodeSnapshot getSnapshot( Time masterTime ){
+    NodeSnapshot snapshot;
+    Time now = this->getLocalTime();
+    snapshot.masterId = masterId;
+    snapshot.hop = hop_num;
+    snapshot.state = nodeState;
+    snapshot.clockOffset = ( now - masterTime ).GetNanoSeconds();
+    snapshot.sinceCorrection = record->servo ? ( now - record->servo->lastCorrectionTime ).GetNanoSeconds() : 0;
+    snapshot.frequencyPpb = record->frequencyPpb;
+    snapshot.wanderPpb = record->wanderPpb;
+    snapshot.rateAdjust = this->getRateAdjust();
+    snapshot.servoIntegral = this->getEstimatedFrequencyError();
+    snapshot.numCorrections = record->numCorrections;
+    snapshot.offset = record->offset.GetNanoSeconds();
+    snapshot.syncSendTime = record->syncSendTime.GetNanoSeconds();
+    snapshot.dreqAtMaster = record->dreqAtMaster.GetNanoSeconds();
+    snapshot.upstreamCorrection = record->upstreamCorrection.GetNanoSeconds();
+    for( uint32_t j = 0; j < record->timeStamps.size(); j++ ){
+      snapshot.timeStamps.push_back( record->timeStamps[j].GetNanoSeconds() );
+    }
+    for( int m = 0; m < NUM_MSG_TYPES; m++ ){
+      snapshot.sentPacket[m] = this->getSentPacketCounter(m);
+      snapshot.receivedPacket[m] = this->getReceivedPacketCounter(m);
+      snapshot.overheardPacket[m] = this->getOverheardPacketCounter(m);
+      snapshot.sentBytes[m] = this->getSentBytes(m);
+      snapshot.airtime[m] = this->getAirtime(m).GetNanoSeconds();
+    }
+    return snapshot;
+  }
+
+  // Takes over the state of a snapshot now: the clock keeps its offset to the master and its rate,
+  // the servo its integral and number of corrections, so the accuracy warm-up is already behind it.
+  // An oscillator model starts a new step with a fresh sample. Counters that are not kept in this
+  // run, see NodeStatistics, are not restored.
+  void restoreSnapshot( const NodeSnapshot &snapshot, Time masterTime ){
+    this->setSyncTree( snapshot.masterId, snapshot.hop );
+    nodeState = snapshot.state;
+    record->frequencyPpb = snapshot.frequencyPpb;
+    record->wanderPpb = snapshot.wanderPpb;
+    if( snapshot.rateAdjust != 1 || snapshot.servoIntegral != 0 || snapshot.sinceCorrection != 0 ){
+      // the servo stays as enabled as setServo left it
+      if( !record->servo ){
+        record->servo.reset( new NodeServo() );
+      }
+      record->servo->rateAdjust = snapshot.rateAdjust;
+      record->servo->integral = snapshot.servoIntegral;
+    }
+    record->numCorrections = snapshot.numCorrections;
+    this->updateRate();
+    simulatorTime = Simulator::Now();
+    record->stepEnd = simulatorTime;
+    localTime = masterTime + NanoSeconds( snapshot.clockOffset );
+    if( record->servo ){
+      record->servo->lastCorrectionTime = localTime - NanoSeconds( snapshot.sinceCorrection );
+    }
+    record->offset = NanoSeconds( snapshot.offset );
+    record->syncSendTime = NanoSeconds( snapshot.syncSendTime );
+    record->dreqAtMaster = NanoSeconds( snapshot.dreqAtMaster );
+    record->upstreamCorrection = NanoSeconds( snapshot.upstreamCorrection );
+    for( uint32_t j = 0; j < record->timeStamps.size() && j < snapshot.timeStamps.size(); j++ ){
+      record->timeStamps[j] = NanoSeconds( snapshot.timeStamps[j] );
+    }
+    for( int m = 0; m < NUM_EXCHANGE_TYPES; m++ ){
+      record->sentPacket[m] = snapshot.sentPacket[m];
+      record->receivedPacket[m] = snapshot.receivedPacket[m];
+    }
+    NodeStatistics *statistics = record->statistics.get();
+    for( int m = 0; statistics != 0 && m < NUM_MSG_TYPES; m++ ){
+      if( m >= NUM_EXCHANGE_TYPES ){
+        statistics->controlSent[m - NUM_EXCHANGE_TYPES] = snapshot.sentPacket[m];
+        statistics->controlReceived[m - NUM_EXCHANGE_TYPES] = snapshot.receivedPacket[m];
+      }
+      statistics->overheardPacket[m] = snapshot.overheardPacket[m];
+      statistics->sentBytes[m] = snapshot.sentBytes[m];
+      statistics->airtime[m] = snapshot.airtime[m];
+    }
   }
 
 
 
 private:
+  static const int64_t PPB = 1000000000; // fixed-point unit of the rates, one part per billion
+
+  // Only what a clock read and the per-packet dispatch touch is kept in the node, everything else
+  // is in its NodeRecord.
   Time localTime;
   Time simulatorTime;
-  Time syncSendTime;
-  Time dreqAtMaster;
-  Time offset;
-  Time waitingTime;
-  Time syncStartTime;
-  Time syncEndTime;
-  Time synchronizationTime;
-  std::vector< Time > timeStamps;
+  int64_t ratePpb; // ticks of the local clock per 10^9 ticks of the master, oscillator and servo together
+  NodeRecord *record;
+  const uint32_t node_id;
+  uint32_t masterId; // parent in the sync tree
+  uint16_t hop_num;
+  uint8_t nodeState;
+  bool isMaster;
+  bool lazyClock;
+  bool oscillating; // an oscillator model is set, its steps have to be advanced on a read
+};
+
+const int64_t WirelessNode::PPB;
+
+
+
+//-------------------------------------------------X--End Of WirelessNode Class--X-----------------------------------------------
+
+
+//-------------------------------------------------X--Start of ClockTrace Class--X------------------------------------------
+
+enum TRACE_LEVEL{
+  TRACE_OFF,      // nothing is recorded
+  TRACE_EVENTS,   // one record per traced protocol event
+  TRACE_CHANGED,  // event records plus a record for every node changed since the previous event
+  TRACE_TABLE     // as TRACE_CHANGED, and the full clock table of all nodes is printed on the console
+};
+
+// One protocol event as recorded in the trace file
+struct TraceEventRow{
+  int64_t time;
+  int id;
+  std::string msgType;
+  int senderHop;
+  std::string senderIp;
+  std::string receiverIp;
+  int64_t dreqAtMaster;
+  int64_t syncSendTime;
+  int64_t masterTime;
+};
+
+// One node as recorded in the trace file, enough to rebuild its row of the clock table
+struct NodeTraceRow{
+  int64_t time;
+  uint32_t nodeId;
   int isMaster;
-  int nodeState;
-  int replyId;
   double clockError;
+  int state;
+  int64_t localTime;
+  int64_t offset;
   double oldOffsetError;
   double newOffsetError;
-  const uint32_t node_id;
-  const uint32_t masterId;
-  const uint32_t hop_num;
-  const Ipv4Address node_ipv4Address;
-  std::vector< int > neighbourIndex; // index to their sockets in the list storing all the sockets of networks
-  std::vector< int > sentPacket; // vector indexed by packet type(Sync, Follow, Dreq, Drply) and stores num of packets sent out 
-  std::vector< int > receivedPacket;// vector indexed by packet type(Sync, Follow, Dreq, Drply) and stores num of packets received
-  std::vector< int > overheardPacket;// vector indexed by packet type(Sync, Follow, Dreq, Drply) and stores num of packets overheard and ignored
-  std::map< int, long long > childDreqTime; // key - nodeId , value - DreqTime
-  std::map< int, long long > dreqSendTime;
-  std::vector< int > sendDrply;
+  int64_t synchronizationTime;
+  int sent[4];
+  int received[4];
+  int64_t ratePpb; // effective rate of the clock, with the servo's adjustment
+
+  // extrapolates the recorded clock to a later event at the rate it ran at when recorded
+  int64_t localTimeAt( int64_t t, int64_t masterTime ) const{
+    if( isMaster ){
+      return masterTime;
+    }
+    return WirelessNode::scaleByRate( ( t - time ) / 5, ratePpb ) + localTime;
+  }
 };
 
+// Buffered CSV trace of the protocol. Instead of printing every node on every event, it writes
+// one 'E' line per event followed by 'N' lines for the nodes changed since the previous event.
+// rebuildTable() turns such a file back into the full per-event clock table offline.
+class ClockTrace{
+public:
+  ClockTrace()
+  : level(TRACE_OFF)
+  {
+  }
 
+  ~ClockTrace(){
+    close();
+  }
 
-//-------------------------------------------------X--End Of WirelessNode Class--X-----------------------------------------------
+  void open( int traceLevel, std::string fileName, uint32_t numNodes ){
+    level = traceLevel;
+    changed.assign( numNodes, 0 );
+    changedNodes.clear();
+    if( level == TRACE_OFF ){
+      return;
+    }
+    buffer.resize( BUFFER_SIZE );
+    out.rdbuf()->pubsetbuf( &buffer[0], buffer.size() );
+    out.open( fileName.c_str(), std::ios::out | std::ios::trunc );
+    out << std::setprecision(17);
+    out << "# E,time_ns,event_id,msg_type,sender_hop,sender_ip,receiver_ip,dreq_at_master_ns,sync_send_time_ns,master_time_ns\n";
+    out << "# N,time_ns,node_id,is_master,clock_error,state,local_time_ns,calc_offset_ns,old_offset_error,new_offset_error,"
+           "sync_time_ns,sync_sent,sync_recv,follow_sent,follow_recv,dreq_sent,dreq_recv,drply_sent,drply_recv,rate_ppb\n";
+  }
+
+  void close(){
+    if( out.is_open() ){
+      out.close();
+    }
+  }
+
+  int getLevel(){
+    return level;
+  }
+
+  // remembers that a node's state changed, it is written with the next event
+  void markChanged( uint32_t nodeIndex ){
+    if( level >= TRACE_CHANGED && !changed[nodeIndex] ){
+      changed[nodeIndex] = 1;
+      changedNodes.push_back( nodeIndex );
+    }
+  }
+
+  void recordEvent( const TraceEventRow &event ){
+    out << "E," << event.time << ',' << event.id << ',' << event.msgType << ',' << event.senderHop << ','
+        << event.senderIp << ',' << event.receiverIp << ',' << event.dreqAtMaster << ','
+        << event.syncSendTime << ',' << event.masterTime << '\n';
+  }
+
+  void recordNode( const NodeTraceRow &row ){
+    out << "N," << row.time << ',' << row.nodeId << ',' << row.isMaster << ',' << row.clockError << ','
+        << row.state << ',' << row.localTime << ',' << row.offset << ',' << row.oldOffsetError << ','
+        << row.newOffsetError << ',' << row.synchronizationTime;
+    for( int m = 0; m < 4; m++ ){
+      out << ',' << row.sent[m] << ',' << row.received[m];
+    }
+    out << ',' << row.ratePpb << '\n';
+  }
+
+  std::vector< uint32_t > & getChangedNodes(){
+    return changedNodes;
+  }
+
+  void clearChanged(){
+    for( size_t j = 0; j < changedNodes.size(); j++ ){
+      changed[ changedNodes[j] ] = 0;
+    }
+    changedNodes.clear();
+  }
+
+  static void printTable( std::ostream &os, const TraceEventRow &event, const std::vector< NodeTraceRow > &rows ){
+    int width = 12;
+    std::string nodeState;
+
+    os << " -----------------------------------------------------------------------------------------------------------------------------------------------" << '\n';
+    os << "  Sender : " << event.senderIp << "          Receiver : " << event.receiverIp << '\n';
+    os << "  Sender-Hop-Number : " << event.senderHop << "      MSG_TYPE : " << event.msgType << "      Id : " << event.id << '\n';
+    os << "  dreqAtMaster :" << std::setw(width) << event.dreqAtMaster << 
+                       " syncSendTime : " << std::setw(width) << event.syncSendTime << '\n';
+    os<<"Id => ClockDev. => ErrBeforeSync => ErrAfterSync => Time => State => Curr.Offset => Calc.Offset => Synchronization Time => Sync  => Follow  => Dreq => Drply "<<'\n';
+
+    for( size_t j = 0; j < rows.size(); j++ ){
+      const NodeTraceRow &row = rows[j];
+      int64_t clockTime = row.localTimeAt( event.time, event.masterTime );
+      int64_t presentOffset = clockTime - event.masterTime;
+      switch( row.state ){
+        case INACTIVE: nodeState = "INACTIVE";
+                break;
+        case ACTIVE: nodeState = "ACTIVE";
+                break;
+        case WAITING: nodeState = "WAITING";
+                break;
+        case SYNCED: nodeState = "SYNCED";
+                break;
+        case HOLDOVER: nodeState = "HOLDOVER";
+                break;
+        default: nodeState = "";
+                break;
+      }
+
+      os << std::setw(2) << row.nodeId << "   " << std::setw(6) << row.clockError << "   ";
+      if( row.state == SYNCED ){
+        os << std::setw(width) << row.oldOffsetError << "    " << std::setw(width) << row.newOffsetError << "    " << std::setw(width) << clockTime << "   " << std::setw(width) << nodeState << "   "<< std::setw(width) << presentOffset << "   " << std::setw(width) << row.offset << "     " <<  row.synchronizationTime;
+      }else{
+        os << std::setw(width) <<  "N/A"        << "    " << std::setw(width) << "N/A"          << "    " << std::setw(width) << clockTime << "   " << std::setw(width) << nodeState << "   "<< std::setw(width) << presentOffset << "   " << std::setw(width) << "N/A"                        << "     " <<  "N/A";
+      }
+      os << "     " << std::setw(2) << row.sent[SYNC] << "   " << std::setw(2) << row.received[SYNC] << std::setw(2) << "   " << row.sent[FOLLOW] << std::setw(2) << "   " << row.received[FOLLOW] << std::setw(2) << "   " << row.sent[DREQ] << std::setw(2) << "   " << row.received[DREQ] << std::setw(2) << "   " << row.sent[DRPLY] << std::setw(2) << "   " << row.received[DRPLY] << '\n';
+    }
+    os<<"-------------------------------------------------------------------------------------------------------------------------------------------------" << '\n';
+    os << '\n';
+    os << '\n';
+  }
+
+  // Offline tool: replays a trace written at TRACE_CHANGED or above and prints the clock table
+  // of every node after every event. Nodes that did not change are extrapolated from their last record.
+  static int rebuildTable( std::string fileName, std::ostream &os ){
+    std::ifstream in( fileName.c_str() );
+    if( !in.is_open() ){
+      std::cerr << "cannot open trace file " << fileName << std::endl;
+      return 1;
+    }
+    std::vector< NodeTraceRow > rows;
+    TraceEventRow event;
+    bool pendingEvent = false;
+    std::string line, item;
+    std::vector< std::string > fields;
+
+    while( std::getline( in, line ) ){
+      if( line.empty() || line[0] == '#' ){
+        continue;
+      }
+      fields.clear();
+      std::stringstream lineStream( line );
+      while( std::getline( lineStream, item, ',' ) ){
+        fields.push_back( item );
+      }
+
+      if( fields[0] == "E" && fields.size() >= 10 ){
+        if( pendingEvent ){
+          printTable( os, event, rows );
+        }
+        event.time = atoll( fields[1].c_str() );
+        event.id = atoi( fields[2].c_str() );
+        event.msgType = fields[3];
+        event.senderHop = atoi( fields[4].c_str() );
+        event.senderIp = fields[5];
+        event.receiverIp = fields[6];
+        event.dreqAtMaster = atoll( fields[7].c_str() );
+        event.syncSendTime = atoll( fields[8].c_str() );
+        event.masterTime = atoll( fields[9].c_str() );
+        pendingEvent = true;
+      }else if( fields[0] == "N" && fields.size() >= 19 ){
+        NodeTraceRow row;
+        row.time = atoll( fields[1].c_str() );
+        row.nodeId = atoi( fields[2].c_str() );
+        row.isMaster = atoi( fields[3].c_str() );
+        row.clockError = atof( fields[4].c_str() );
+        row.state = atoi( fields[5].c_str() );
+        row.localTime = atoll( fields[6].c_str() );
+        row.offset = atoll( fields[7].c_str() );
+        row.oldOffsetError = atof( fields[8].c_str() );
+        row.newOffsetError = atof( fields[9].c_str() );
+        row.synchronizationTime = atoll( fields[10].c_str() );
+        for( int m = 0; m < 4; m++ ){
+          row.sent[m] = atoi( fields[11 + 2 * m].c_str() );
+          row.received[m] = atoi( fields[12 + 2 * m].c_str() );
+        }
+        // traces without the rate column only have the free-running rate
+        row.ratePpb = fields.size() >= 20 ? atoll( fields[19].c_str() ) : std::llround( row.clockError * 1e9 );
+        if( rows.size() < row.nodeId ){
+          rows.resize( row.nodeId );
+          for( size_t j = 0; j < rows.size(); j++ ){
+            rows[j].nodeId = j + 1;
+          }
+        }
+        rows[ row.nodeId - 1 ] = row;
+      }
+    }
+    if( pendingEvent ){
+      printTable( os, event, rows );
+    }
+    os.flush();
+    return 0;
+  }
+
+  static const size_t BUFFER_SIZE = 1 << 20;
+
+private:
+  int level;
+  std::ofstream out;
+  std::vector< char > buffer;
+  std::vector< uint8_t > changed;       // indexed by node index, 1 if queued in changedNodes
+  std::vector< uint32_t > changedNodes; // nodes changed since the last recorded event
+};
+
+//-------------------------------------------------X--End of ClockTrace Class--X------------------------------------------
+
+
+//-------------------------------------------------X--Start of EventSequencer Class--X------------------------------------------
+
+// A send that was attempted before the event it belongs to was released
+struct ParkedSend{
+  ParkedSend( int type, WirelessNode * node, Ptr<Socket> sock, int event )
+  : msgType(type),
+    txNode(node),
+    socket(sock),
+    id(event)
+  {
+  }
+
+  int msgType;
+  WirelessNode * txNode;
+  Ptr<Socket> socket;
+  int id;
+};
+
+// A SYNC or DREQ whose send time is taken from the PHY. The MAC retries a unicast frame that is
+// not acknowledged, and the receiver timestamps the attempt it gets, so every attempt overwrites
+// sendTime until the frame is received; see phyTxBegin and finishTxStamp.
+struct PendingTxStamp{
+  PendingTxStamp( const ParkedSend & parked, Time appTime )
+  : send(parked),
+    sendTime(appTime),
+    attempts(0)
+  {
+  }
+
+  ParkedSend send;
+  Time sendTime; // local time of the latest attempt, the application send time before the first
+  uint32_t attempts;
+};
+
+// Orders the protocol events. Event ids are handed out in sequence; event id is released once
+// every packet sent for event id-1 has been received. Sends of events that are not released yet
+// are parked and handed back the moment their event is released, so nothing has to poll.
+// Only the packet counts of unfinished events are kept, so the number of event ids is unbounded.
+class EventSequencer{
+public:
+  EventSequencer()
+  : currentId(0),
+    firstId(0),
+    enabled(true)
+  {
+  }
+
+  // every event counts as released and nothing is counted, for schedulers that order sends themselves
+  void disable(){
+    enabled = false;
+  }
+
+  int getCurrentId(){
+    return currentId;
+  }
+
+  bool hasParked(){
+    return !parked.empty();
+  }
+
+  bool isReleased( int id ){
+    return !enabled || id <= currentId;
+  }
+
+  // count is the number of receivers a single transmission is expected to reach
+  void addPacket( int id, int count = 1 ){
+    if( enabled && id >= firstId ){
+      counter(id) += count;
+    }
+  }
+
+  // returns true if the reception completed the current event and released the next one. A late
+  // packet of an event expire gave up on changes nothing.
+  bool removePacket( int id ){
+    if( !enabled || id < firstId ){
+      return false;
+    }
+    counter(id)--;
+    if( counter(currentId) != 0 ){
+      return false;
+    }
+    advance();
+    return true;
+  }
+
+  // The send of event id is dropped, its node is silent: if it is the current event and nothing was
+  // sent for it, the next one is released. Returns true if it was.
+  bool skip( int id ){
+    if( !enabled || id != currentId || counter(currentId) != 0 ){
+      return false;
+    }
+    advance();
+    return true;
+  }
+
+  void park( int id, const ParkedSend &send ){
+    parked[id].push_back( send );
+  }
+
+  // Gives up on the current event when its packets will not all arrive, because their receiver
+  // failed or a frame was lost, and moves on to the first event with parked sends. Returns true
+  // if there was such an event. An event that sent nothing yet is still waiting for its timer
+  // and is kept.
+  bool expire(){
+    if( !enabled || parked.empty() || counter(currentId) <= 0 ){
+      return false;
+    }
+    currentId = std::max( currentId + 1, parked.begin()->first );
+    while( firstId < currentId ){
+      if( !packetCount.empty() ){
+        packetCount.pop_front();
+      }
+      firstId++;
+    }
+    return true;
+  }
+
+  // moves the sends parked for the current event into released
+  void takeReleased( std::vector< ParkedSend > &released ){
+    released.clear();
+    std::map< int, std::vector< ParkedSend > >::iterator it = parked.begin();
+    while( it != parked.end() && it->first <= currentId ){
+      released.insert( released.end(), it->second.begin(), it->second.end() );
+      parked.erase( it++ );
+    }
+  }
+
+private:
+  void advance(){
+    currentId++;
+    while( firstId < currentId ){
+      packetCount.pop_front();
+      firstId++;
+    }
+  }
+
+  int & counter( int id ){
+    while( packetCount.size() <= (size_t)( id - firstId ) ){
+      packetCount.push_back( 0 );
+    }
+    return packetCount[ id - firstId ];
+  }
+
+  int currentId;
+  int firstId;                  // event id of packetCount.front()
+  std::deque< int > packetCount; // packets in flight of every event from firstId on
+  std::map< int, std::vector< ParkedSend > > parked;
+  bool enabled;
+};
+
+//-------------------------------------------------X--End of EventSequencer Class--X------------------------------------------
+
+
+//-------------------------------------------------X--Start of PhyTimestamps Class--X------------------------------------------
+
+// Start-of-frame receive times reported by the Wi-Fi PHY, keyed by packet uid. A PHY receives
+// one frame at a time and the packet reaches the socket at the end of that frame, so a short
+// ring per node always still holds the frame a received packet arrived in.
+class PhyTimestamps{
+public:
+  void resize( uint32_t numNodes ){
+    uids.assign( numNodes * SLOTS, NO_UID );
+    times.assign( numNodes * SLOTS, NanoSeconds (0) );
+    next.assign( numNodes, 0 );
+  }
+
+  bool isEnabled(){
+    return !next.empty();
+  }
+
+  void record( uint32_t node, uint64_t uid, Time t ){
+    uint32_t slot = node * SLOTS + next[node];
+    uids[slot] = uid;
+    times[slot] = t;
+    next[node] = ( next[node] + 1 ) % SLOTS;
+  }
+
+  // newest first, a frame that was retried is found by its last attempt
+  bool lookup( uint32_t node, uint64_t uid, Time &t ){
+    for( uint32_t j = 1; j <= SLOTS; j++ ){
+      uint32_t slot = node * SLOTS + ( next[node] + SLOTS - j ) % SLOTS;
+      if( uids[slot] == uid ){
+        t = times[slot];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static const uint32_t SLOTS = 4;
+  static const uint64_t NO_UID = ~(uint64_t) 0;
+
+private:
+  std::vector< uint64_t > uids;
+  std::vector< Time > times;
+  std::vector< uint32_t > next; // slot of every node that is overwritten next
+};
+
+const uint32_t PhyTimestamps::SLOTS;
+const uint64_t PhyTimestamps::NO_UID;
+
+//-------------------------------------------------X--End of PhyTimestamps Class--X------------------------------------------
+
+
+//-------------------------------------------------X--Start of PacketCapture Class--X------------------------------------------
+
+// Filtered pcap capture of the frames the nodes transmit. Frames are taken at the start of the
+// transmission at the PHY and written once, by their sender, at their first attempt. A frame is
+// kept if its sender is in the node subset, it starts inside the time window and its message type
+// passes the filter; frames that carry no protocol message, such as ARP, only pass without a type
+// filter. With a ring buffer the last bufferSize frames are kept in memory instead and written only
+// when trigger() is called, on an offset error above the threshold, and with flushAtEnd also when
+// the capture is closed.
+class PacketCapture{
+public:
+  PacketCapture()
+  : typeMask(0),
+    bufferSize(0),
+    next(0),
+    errorThreshold(0),
+    flushAtEnd(false),
+    pendingLifetime(Seconds (1)),
+    triggers(0),
+    written(0)
+  {
+  }
+
+  // nodeMask selects the senders, typeMask the message types by bit, 0 for all frames;
+  // a zero windowStop keeps the window open until the end
+  bool open( std::string fileName, const std::vector< bool > &nodeMask, uint32_t types, Time windowStart,
+    Time windowStop, uint32_t buffer, double threshold, bool flushBufferAtEnd ){
+    PcapHelper pcapHelper;
+    file = pcapHelper.CreateFile( fileName, std::ios::out, PcapHelper::DLT_IEEE802_11 );
+    if( file == 0 ){
+      std::cerr << "cannot open capture file " << fileName << std::endl;
+      return false;
+    }
+    nodes = nodeMask;
+    typeMask = types;
+    start = windowStart;
+    stop = windowStop;
+    bufferSize = buffer;
+    errorThreshold = threshold;
+    flushAtEnd = flushBufferAtEnd;
+    ring.reserve( bufferSize );
+    return true;
+  }
+
+  bool isOpen(){
+    return file != 0;
+  }
+
+  bool isCaptured( uint32_t nodeIndex ){
+    return nodes[nodeIndex];
+  }
+
+  // Remembers the message type of a packet handed to a socket until its frame starts at the PHY.
+  // A packet sent to several neighbours is tagged once per copy, the copies share its uid.
+  void tag( uint32_t nodeIndex, uint64_t uid, int msgType ){
+    if( file == 0 || !nodes[nodeIndex] ){
+      return;
+    }
+    Time now = Simulator::Now();
+    if( now - lastPurge >= pendingLifetime ){
+      purgePending( now );
+    }
+    std::map< uint64_t, PendingFrame >::iterator it = pending.find( uid );
+    if( it == pending.end() ){
+      pending.insert( std::make_pair( uid, PendingFrame( msgType, now ) ) );
+    }else{
+      it->second.copies++;
+      it->second.tagged = now;
+    }
+  }
+
+  void frameTxBegin( uint32_t nodeIndex, Ptr<const Packet> packet ){
+    if( !nodes[nodeIndex] ){
+      return;
+    }
+    // a MAC retry starts a frame that was already written at its first attempt
+    WifiMacHeader header;
+    packet->PeekHeader( header );
+    if( header.IsRetry() ){
+      return;
+    }
+    int msgType = NUM_MSG_TYPES;
+    std::map< uint64_t, PendingFrame >::iterator it = pending.find( packet->GetUid() );
+    if( it != pending.end() ){
+      msgType = it->second.msgType;
+      if( --it->second.copies == 0 ){
+        pending.erase( it );
+      }
+    }
+    Time now = Simulator::Now();
+    if( now < start || ( stop.IsStrictlyPositive() && now >= stop ) ){
+      return;
+    }
+    if( typeMask != 0 && ( msgType == NUM_MSG_TYPES || ( typeMask & ( 1u << msgType ) ) == 0 ) ){
+      return;
+    }
+    if( bufferSize == 0 ){
+      file->Write( now, packet );
+      written++;
+      return;
+    }
+    if( ring.size() < bufferSize ){
+      ring.push_back( CapturedFrame( now, packet ) );
+    }else{
+      ring[next] = CapturedFrame( now, packet );
+    }
+    next = ( next + 1 ) % bufferSize;
+  }
+
+  // the offset error of a node just before its correction, local ns
+  void noteError( double error ){
+    if( errorThreshold > 0 && error > errorThreshold ){
+      trigger();
+    }
+  }
+
+  // writes the buffered frames, oldest first, and empties the buffer
+  void trigger(){
+    if( file == 0 || ring.empty() ){
+      return;
+    }
+    triggers++;
+    uint32_t first = ring.size() < bufferSize ? 0 : next;
+    for( uint32_t j = 0; j < ring.size(); j++ ){
+      CapturedFrame &frame = ring[ ( first + j ) % ring.size() ];
+      file->Write( frame.time, frame.packet );
+    }
+    written += ring.size();
+    ring.clear();
+    next = 0;
+  }
+
+  // without flushAtEnd the frames still buffered are dropped: no trigger fired for them
+  void close(){
+    if( flushAtEnd ){
+      trigger();
+    }
+    ring.clear();
+    pending.clear();
+    file = 0;
+  }
+
+  void printReport( std::ostream &os ){
+    os << "Capture: " << written << " frames written";
+    if( bufferSize > 0 ){
+      os << " from " << triggers << " buffer flushes of up to " << bufferSize << " frames";
+    }
+    os << '\n';
+    os.flush();
+  }
+
+private:
+  struct PendingFrame{
+    PendingFrame( int type, Time t )
+    : msgType(type),
+      copies(1),
+      tagged(t)
+    {
+    }
+
+    int msgType;
+    uint32_t copies; // copies handed to sockets that did not start at the PHY yet
+    Time tagged;
+  };
+
+  // Forgets the frames that never reached the PHY: the MAC queue drops a frame after at most
+  // half a second, so a tag older than pendingLifetime will not be asked for any more.
+  void purgePending( Time now ){
+    std::map< uint64_t, PendingFrame >::iterator it = pending.begin();
+    while( it != pending.end() ){
+      if( now - it->second.tagged >= pendingLifetime ){
+        pending.erase( it++ );
+      }else{
+        ++it;
+      }
+    }
+    lastPurge = now;
+  }
+
+  struct CapturedFrame{
+    CapturedFrame( Time t, Ptr<const Packet> p )
+    : time(t),
+      packet(p)
+    {
+    }
+
+    Time time;
+    Ptr<const Packet> packet;
+  };
+
+  Ptr<PcapFileWrapper> file;
+  std::vector< bool > nodes;
+  uint32_t typeMask;
+  Time start;
+  Time stop;
+  uint32_t bufferSize;
+  std::vector< CapturedFrame > ring;
+  uint32_t next; // slot of the ring overwritten next
+  double errorThreshold;
+  bool flushAtEnd;
+  std::map< uint64_t, PendingFrame > pending; // by packet uid, until the first attempt of every copy
+  Time pendingLifetime;
+  Time lastPurge;
+  uint32_t triggers;
+  uint64_t written;
+};
+
+static void captureTxBeginAt( PacketCapture *capture, uint32_t nodeIndex, Ptr<const Packet> packet ){
+  capture->frameTxBegin( nodeIndex, packet );
+}
+
+//-------------------------------------------------X--End of PacketCapture Class--X------------------------------------------
+
+
+//-------------------------------------------------X--Start of ScenarioMetrics--X------------------------------------------
+
+enum METRIC{
+  METRIC_SYNC_TIME,        // seconds from the first SYNC until every node synchronized once, -1 if some never did
+  METRIC_SYNCED_FRACTION,  // fraction of the non-master nodes that synchronized
+  METRIC_MEAN_OFFSET,      // mean |local - master| over the non-master nodes at the end, local ns
+  METRIC_MAX_OFFSET,       // max |local - master| at the end, local ns
+  METRIC_STEADY_RMS,       // mean of the per-node steady-state RMS error of periodic sync, local ns
+  METRIC_ERROR_P50,        // median |local - master| right after a correction over all corrections, local ns
+  METRIC_ERROR_P95,
+  METRIC_ERROR_P99,
+  METRIC_PACKETS_SENT,     // protocol messages sent by all nodes
+  METRIC_PACKETS_RECEIVED, // protocol messages accepted by all nodes
+  METRIC_BYTES_SENT,       // UDP payload bytes of all transmissions
+  METRIC_AIRTIME,          // seconds of channel time of all transmissions
+  METRIC_CHANNEL_OCCUPANCY,// airtime over the time from the first SYNC to the end of the last transmission
+  METRIC_WALL_TIME,        // wall clock seconds of the run
+  METRIC_EVENTS,           // simulator events executed
+  METRIC_RECEIVE_TIME,     // wall clock seconds spent in WirelessNetwork::receivePacket, if profiled
+  METRIC_PEAK_RSS,         // peak resident set size of the worker process in MiB, filled by the sweep runner
+  METRIC_NODE_MEMORY,      // mean bytes of WirelessNode state per node
+  METRIC_ANNOUNCES,        // announce messages of the master election
+  METRIC_TREE_DEPTH,       // hops of the deepest node of the sync tree
+  METRIC_DETECT_TIME,      // seconds from the master failure to its first detection, -1 without failure
+  METRIC_RESYNC_TIME,      // seconds from the master failure until every node synchronized to the backup, -1 if not
+  METRIC_OUTAGE_PEAK_OFFSET, // largest offset in ns between the master failure and the resync
+  METRIC_LINK_CHANGES,     // links found or lost by the neighbour discovery
+  METRIC_REPARENTS,        // nodes that changed their parent in the sync tree
+  METRIC_REPAIR_MESSAGES,  // triggered HELLOs of the local tree repair
+  METRIC_SEND_FAILURES,    // packets a socket refused to send
+  NUM_METRICS
+};
+
+// Outcome of one simulation run, collected by WirelessNetwork::collectMetrics
+struct ScenarioMetrics{
+  ScenarioMetrics(){
+    for( int m = 0; m < NUM_METRICS; m++ ){
+      values[m] = 0;
+    }
+  }
+
+  static const char * name( int metric ){
+    static const char * names[NUM_METRICS] = { "sync_time_s", "synced_fraction", "mean_offset_ns", "max_offset_ns",
+      "steady_rms_ns", "error_p50_ns", "error_p95_ns", "error_p99_ns", "packets_sent", "packets_received", "bytes_sent", "airtime_s", "channel_occupancy", "wall_time_s", "events", "receive_time_s", "peak_rss_mb", "node_memory_bytes", "announce_messages", "tree_depth",
+      "detect_time_s", "resync_time_s", "outage_peak_offset_ns",
+      "link_changes", "reparents", "repair_messages", "send_failures" };
+    return names[metric];
+  }
+
+  double values[NUM_METRICS];
+};
+
+//-------------------------------------------------X--End of ScenarioMetrics--X------------------------------------------
+
+
+//-------------------------------------------------X--Start of ConvergenceStats Class--X------------------------------------------
+
+// Streaming quantile sketch with relative accuracy: a value x >= 1 is counted in the bucket
+// ceil(log_gamma(x)), gamma = (1 + accuracy) / (1 - accuracy), so every quantile is within
+// accuracy of the true value. Values below 1 are counted as zero. Only occupied buckets are
+// stored, memory is bounded by the log of the value range whatever the number of samples.
+class QuantileSketch{
+public:
+  QuantileSketch( double accuracy = 0.01 )
+  : gamma( ( 1 + accuracy ) / ( 1 - accuracy ) ),
+    logGamma( std::log( gamma ) ),
+    count(0),
+    zeros(0),
+    sum(0),
+    max(0)
+  {
+  }
+
+  void add( double x ){
+    count++;
+    sum += x;
+    max = std::max( max, x );
+    if( x < 1 ){
+      zeros++;
+      return;
+    }
+    buckets[ (int32_t) std::ceil( std::log( x ) / logGamma ) ]++;
+  }
+
+  double quantile( double q ){
+    if( count == 0 ){
+      return 0;
+    }
+    uint64_t rank = (uint64_t)( q * ( count - 1 ) ), seen = zeros;
+    if( rank < seen ){
+      return 0;
+    }
+    for( std::map< int32_t, uint64_t >::iterator it = buckets.begin(); it != buckets.end(); it++ ){
+      seen += it->second;
+      if( seen > rank ){
+        return std::min( valueOf( it->first ), max );
+      }
+    }
+    return max;
+  }
+
+  // samples per decade: [0,1) [1,10) [10,100) ...
+  void decades( std::vector< uint64_t > &counts ){
+    counts.assign( 1, zeros );
+    for( std::map< int32_t, uint64_t >::iterator it = buckets.begin(); it != buckets.end(); it++ ){
+      size_t decade = (size_t)( std::log10( valueOf( it->first ) ) ) + 1;
+      if( counts.size() <= decade ){
+        counts.resize( decade + 1, 0 );
+      }
+      counts[decade] += it->second;
+    }
+  }
+
+  uint64_t getCount(){
+    return count;
+  }
+
+  double getMean(){
+    return count ? sum / count : 0;
+  }
+
+  double getMax(){
+    return max;
+  }
+
+private:
+  double valueOf( int32_t bucket ){
+    return 2 * std::pow( gamma, bucket ) / ( gamma + 1 );
+  }
+
+  double gamma;
+  double logGamma;
+  uint64_t count;
+  uint64_t zeros;
+  double sum;
+  double max;
+  std::map< int32_t, uint64_t > buckets;
+};
+
+enum STAT{
+  STAT_SYNC_LATENCY, // local ns from the reception of the SYNC/upstream DREQ to the DRPLY that completes the exchange
+  STAT_ERROR_BEFORE, // |local - master| right before a correction, local ns
+  STAT_ERROR_AFTER,  // |local - master| right after a correction, local ns
+  NUM_STATS
+};
+
+// Distributions of every correction made during a run, overall and of the error after the
+// correction per hop, printed as p50/p95/p99 rows at checkpoints and at the end of the run.
+class ConvergenceStats{
+public:
+  void addCorrection( uint16_t hop, Time latency, double errorBefore, double errorAfter ){
+    sketches[STAT_SYNC_LATENCY].add( latency.GetNanoSeconds() );
+    sketches[STAT_ERROR_BEFORE].add( errorBefore );
+    sketches[STAT_ERROR_AFTER].add( errorAfter );
+    if( errorAfterByHop.size() <= hop ){
+      errorAfterByHop.resize( hop + 1 );
+    }
+    errorAfterByHop[hop].add( errorAfter );
+  }
+
+  QuantileSketch & get( int stat ){
+    return sketches[stat];
+  }
+
+  uint64_t getNumCorrections(){
+    return sketches[STAT_ERROR_AFTER].getCount();
+  }
+
+  static void printHeader( std::ostream &os ){
+    os << "time_s,metric,count,mean,p50,p95,p99,max" << '\n';
+  }
+
+  void print( std::ostream &os, double time ){
+    static const char * names[NUM_STATS] = { "sync_latency_ns", "error_before_ns", "error_after_ns" };
+    for( int m = 0; m < NUM_STATS; m++ ){
+      printRow( os, time, names[m], sketches[m] );
+    }
+    for( size_t h = 1; h < errorAfterByHop.size(); h++ ){
+      std::ostringstream name;
+      name << "error_after_ns_hop" << h;
+      printRow( os, time, name.str(), errorAfterByHop[h] );
+    }
+    os.flush();
+  }
+
+  void printHistograms( std::ostream &os ){
+    static const char * names[NUM_STATS] = { "Sync latency", "Error before correction", "Error after correction" };
+    std::vector< uint64_t > counts;
+    for( int m = 0; m < NUM_STATS; m++ ){
+      sketches[m].decades( counts );
+      os << names[m] << " (local ns):";
+      for( size_t d = 0; d < counts.size(); d++ ){
+        os << "  [" << ( d == 0 ? 0 : std::pow( 10.0, d - 1.0 ) ) << "," << std::pow( 10.0, (double) d ) << ") " << counts[d];
+      }
+      os << '\n';
+    }
+    os.flush();
+  }
+
+private:
+  static void printRow( std::ostream &os, double time, std::string name, QuantileSketch &sketch ){
+    os << time << ',' << name << ',' << sketch.getCount() << ',' << sketch.getMean() << ',' << sketch.quantile( 0.5 )
+       << ',' << sketch.quantile( 0.95 ) << ',' << sketch.quantile( 0.99 ) << ',' << sketch.getMax() << '\n';
+  }
+
+  QuantileSketch sketches[NUM_STATS];
+  std::vector< QuantileSketch > errorAfterByHop;
+};
+
+//-------------------------------------------------X--End of ConvergenceStats Class--X------------------------------------------
+
+
+//-------------------------------------------------X--Start of WirelessNetwork Class--X------------------------------------------
+
+// A DREQ of a child that is answered once the parent has this round's timestamps (slotted mode)
+struct PendingReply{
+  PendingReply( uint32_t id, Time t )
+  : requesterId(id),
+    requestTime(t)
+  {
+  }
+
+  uint32_t requesterId;
+  Time requestTime; // local time at which the DREQ was received
+};
+
+// Best clock a node knows during the master election, compared as in the best master clock
+// algorithm reduced to the fields this simulation has: priority1, then the grandmaster identity
+// (node id); for the same grandmaster fewer steps removed, then the lower parent id. A later
+// epoch beats everything: it is started by a node that lost its master, and makes the nodes it
+// reaches forget the clocks they knew.
+struct BmcDataset{
+  BmcDataset()
+  : epoch(0),
+    priority(0),
+    grandmasterId(0),
+    stepsRemoved(0),
+    parentId(0)
+  {
+  }
+
+  BmcDataset( uint32_t e, uint8_t p, uint32_t gm, uint16_t steps, uint32_t parent )
+  : epoch(e),
+    priority(p),
+    grandmasterId(gm),
+    stepsRemoved(steps),
+    parentId(parent)
+  {
+  }
+
+  bool isBetterThan( const BmcDataset &other ) const{
+    if( epoch != other.epoch ) return epoch > other.epoch;
+    if( !sameClock( other ) ) return priority < other.priority || ( priority == other.priority && grandmasterId < other.grandmasterId );
+    if( stepsRemoved != other.stepsRemoved ) return stepsRemoved < other.stepsRemoved;
+    return parentId < other.parentId;
+  }
+
+  // what an ANNOUNCE advertises is the same, only the parent may differ
+  bool sameClock( const BmcDataset &other ) const{
+    return epoch == other.epoch && priority == other.priority && grandmasterId == other.grandmasterId;
+  }
+
+  uint32_t epoch;
+  uint8_t priority;
+  uint32_t grandmasterId;
+  uint16_t stepsRemoved;
+  uint32_t parentId;
+};
 
+// A neighbour found by the neighbour discovery, as its last HELLO described it
+struct NeighbourEntry{
+  NeighbourEntry( uint32_t neighbourId, Time heard )
+  : id(neighbourId),
+    hop(0xFFFF),
+    parentId(0),
+    lastHeard(heard)
+  {
+  }
 
-//-------------------------------------------------X--Start of WirelessNetwork Class--X------------------------------------------
+  uint32_t id;
+  uint16_t hop;
+  uint32_t parentId;
+  Time lastHeard;
+};
 
 class WirelessNetwork
 {
@@ -448,12 +2222,48 @@ public:
       m_interPacketInterval (interPacketInterval)
   {
     masterIndex = 0;
+    lazyClocks = true;
+    transparentClock = false;
+    slotted = false;
+    numSlots = 1;
+    replyTo = 0;
+    oneStep = false;
+    txStampTimeout = MilliSeconds (100); // well above the longest retry chain of the MAC
+    broadcast = false;
+    rightSizedFrames = false;
+    dataRate = 1;
+    ofdm = false;
+    totalAirtime = NanoSeconds (0);
+    profiling = false;
+    receiveTime = 0;
+    syncRound = 0;
+    syncRounds = 1;
+    syncedNodes = 0;
     eventId = 0;
-    eventCounterIndex = 0;
-    for (int i = 0; i < 100; ++i)
-    {
-      eventCounter.push_back(0);
-    }
+    correctionsAtCheckpoint = 0;
+    election = false;
+    announcesSent = 0;
+    treeDepth = 0;
+    syncTimeout = 0;
+    failoverStarted = false;
+    failoverApplied = false;
+    treeEpoch = 0;
+    resyncPending = 0;
+    stallTimeout = NanoSeconds (0);
+    stallEventId = -1;
+    outagePeakOffset = 0;
+    mobile = false;
+    helloLoss = 3;
+    linkChanges = 0;
+    reparents = 0;
+    repairMessages = 0;
+    movedResyncSum = 0;
+    movedResyncSamples = 0;
+    capture = 0;
+    sendFailures = 0;
+    controlSent = 0;
+    controlReceived = 0;
+    bytesSent = 0;
   }
 
   void SetSocketIndex( int* index){
@@ -464,80 +2274,526 @@ public:
     socketsInNetwork = sinks;
   }
 
+  void SetLazyClocks( bool lazy ){
+    lazyClocks = lazy;
+  }
+
+  // Keeps the per-node statistics, see NodeStatistics: offset errors, steady-state accuracy,
+  // overheard and control messages, bytes and airtime per type. Without them a node only counts the
+  // messages of its exchanges, and the metrics take their totals from the network.
+  void SetNodeStatistics( bool enabled ){
+    for( uint32_t j=0; enabled && j< nodes.size(); j++){
+      nodes[j]->enableStatistics();
+    }
+  }
+
+  // switches every node to a constant-size correction field instead of the per-hop timestamp vector
+  void SetTransparentClock( bool enabled ){
+    transparentClock = enabled;
+    for( uint32_t j=0; enabled && j< nodes.size(); j++){
+      nodes[j]->setTransparentClock();
+    }
+  }
+
+  // Takes send and receive timestamps from the Wi-Fi PHY (TX begin, RX begin) instead of the
+  // application, see phyTxBegin and phyRxBegin. Call after addNodesToNetwork.
+  void SetPhyTimestamps( bool enabled ){
+    if( enabled ){
+      phyStamps.resize( nodes.size() );
+    }
+  }
+
+  void phyRxBegin( uint32_t nodeIndex, Ptr<const Packet> packet ){
+    phyStamps.record( nodeIndex, packet->GetUid(), Simulator::Now() );
+  }
+
+  // Registers a SYNC or DREQ frame whose send time is taken at its TX begin. Call before the
+  // packet is handed to the socket, the PHY may start the frame right away.
+  void awaitTxBegin( Ptr<Packet> packet, const ParkedSend & send ){
+    awaitingTxBegin.insert( std::make_pair( packet->GetUid(), PendingTxStamp( send, send.txNode->getLocalTime() ) ) );
+    Simulator::Schedule( txStampTimeout, &WirelessNetwork::expireTxStamp, this, packet->GetUid() );
+  }
+
+  // A frame registered in awaitingTxBegin starts on the air: every attempt overwrites the send
+  // time. Broadcast frames are never retried, so they are done at their first attempt; unicast
+  // frames are done when they are received.
+  void phyTxBegin( uint32_t nodeIndex, Ptr<const Packet> packet ){
+    std::map< uint64_t, PendingTxStamp >::iterator it = awaitingTxBegin.find( packet->GetUid() );
+    if( it == awaitingTxBegin.end() || it->second.send.txNode->getNodeId() - 1 != nodeIndex ){
+      return;
+    }
+    trace.markChanged( nodeIndex );
+    PendingTxStamp & pending = it->second;
+    pending.sendTime = pending.send.txNode->localTimeAt( Simulator::Now() );
+    pending.attempts++;
+    if( pending.send.msgType == DREQ ){
+      pending.send.txNode->addTimeStamp( pending.sendTime, pending.send.txNode->getNodeHop(), 2 );
+    }
+    if( broadcast ){
+      finishTxStamp( it );
+    }
+  }
+
+  // The send time of a frame is final: a SYNC sends its FOLLOW carrying it. A frame that never
+  // reached the PHY keeps its application send time.
+  void finishTxStamp( std::map< uint64_t, PendingTxStamp >::iterator it ){
+    PendingTxStamp pending = it->second;
+    awaitingTxBegin.erase( it );
+    trace.markChanged( pending.send.txNode->getNodeId() - 1 );
+    if( pending.send.msgType == SYNC ){
+      // the node may have sent other SYNCs since, the FOLLOW carries the time of this one
+      pending.send.txNode->setSyncSendTime( pending.sendTime );
+      Simulator::ScheduleNow( &WirelessNetwork::sendFollowPacket, this, pending.send.txNode, pending.send.socket, pending.send.id );
+    }else if( pending.attempts == 0 ){
+      pending.send.txNode->addTimeStamp( pending.sendTime, pending.send.txNode->getNodeHop(), 2 );
+    }
+  }
+
+  // A frame that is still not received after txStampTimeout (the MAC gave up on it, or it never
+  // left the queue) is done with the send time it has, so a SYNC still gets its FOLLOW.
+  void expireTxStamp( uint64_t uid ){
+    std::map< uint64_t, PendingTxStamp >::iterator it = awaitingTxBegin.find( uid );
+    if( it != awaitingTxBegin.end() ){
+      finishTxStamp( it );
+    }
+  }
+
+  // Slotted mode: the sequencer is switched off and the branches of the sync tree run their
+  // exchanges concurrently, so a round takes time proportional to the depth of the tree instead of
+  // the number of nodes. A node transmits only in its own slot of a TDMA frame of numColors slots;
+  // colors is a distance-2 coloring of the topology, so nodes that are neighbours or share a
+  // neighbour never transmit in the same slot. DREQs are answered by the parent only, once it is
+  // synchronized itself. A zero length sizes the slot to the longest burst a node sends at once.
+  // Call after SetBroadcast, SetTransparentClock and SetFrameSizing.
+  void SetSlotSchedule( const std::vector< uint32_t > &colors, uint32_t numColors, Time length ){
+    slotted = true;
+    sequencer.disable();
+    slotColor = colors;
+    numSlots = std::max( numColors, (uint32_t) 1 );
+    nextFreeSlot.assign( nodes.size(), NanoSeconds (0) );
+    pendingReplies.assign( nodes.size(), std::vector< PendingReply >() );
+    if( length.IsStrictlyPositive() ){
+      slotLength = length;
+      return;
+    }
+    uint32_t maxHop = 0, burst = 2; // SYNC and FOLLOW
+    for( uint32_t j=0; j< nodes.size(); j++){
+      maxHop = std::max( maxHop, (uint32_t) nodes[j]->getNodeHop() );
+      if( !broadcast ){
+        burst = std::max( burst, (uint32_t) nodes[j]->getNumNeighbour() );
+      }
+    }
+    uint32_t payload = PtpHeader::FIXED_SIZE + ( transparentClock ? 0 : 8 * 3 * maxHop );
+    if( !rightSizedFrames ){
+      payload = std::max( payload, m_packetSize );
+    }
+    Time contention = MicroSeconds( ofdm ? 100 : 360 ); // DIFS and the mean backoff of CWmin
+    slotLength = NanoSeconds( ( frameAirtime( payload, !broadcast ) + contention ).GetNanoSeconds() * burst );
+  }
+
+  uint32_t getNumSlots(){
+    return numSlots;
+  }
+
+  Time getSlotLength(){
+    return slotLength;
+  }
+
+  // delay until the start of the next slot of txNode that is still free, which is then taken
+  Time reserveSlot( WirelessNode * txNode ){
+    uint32_t index = txNode->getNodeId() - 1;
+    int64_t length = slotLength.GetNanoSeconds();
+    int64_t frame = length * numSlots, offset = length * slotColor[index];
+    int64_t earliest = std::max( Simulator::Now(), nextFreeSlot[index] ).GetNanoSeconds();
+    int64_t frames = earliest > offset ? ( earliest - offset + frame - 1 ) / frame : 0;
+    int64_t start = frames * frame + offset;
+    nextFreeSlot[index] = NanoSeconds( start + length );
+    return NanoSeconds( start ) - Simulator::Now();
+  }
+
+  // answers the DREQs of a node's children, each in a slot of its own
+  void scheduleReplies( WirelessNode * node ){
+    std::vector< PendingReply > &pending = pendingReplies[ node->getNodeId() - 1 ];
+    for( size_t j = 0; j < pending.size(); j++ ){
+      Simulator::Schedule( reserveSlot( node ), &WirelessNetwork::sendSlottedDrplyPacket, this, node,
+        pending[j].requesterId, pending[j].requestTime );
+    }
+    pending.clear();
+  }
+
+  // One-step clock: the master stamps the SYNC at send time and sends no FOLLOW
+  void SetOneStep( bool enabled ){
+    oneStep = enabled;
+  }
+
+  // Broadcast dissemination: socketsInNetwork holds one socket per node, in node order, and every
+  // message is sent once to the link-local broadcast address. Receivers keep the messages whose
+  // sender id is one of their neighbours in m_neighbourNode and count the others as overheard.
+  void SetBroadcast( bool enabled ){
+    broadcast = enabled;
+    neighbourStart.clear();
+    if( !enabled ){
+      return;
+    }
+    neighbourStart.push_back( 0 );
+    for( uint32_t j=0; j< m_neighbourNode.size(); j++){
+      if( m_neighbourNode[j] == -1 ){
+        neighbourStart.push_back( j + 1 );
+      }
+    }
+  }
+
+  uint32_t numNeighboursOf( uint32_t nodeIndex ){
+    if( mobile ){
+      return neighbourTable[nodeIndex].size();
+    }
+    return neighbourStart[nodeIndex+1] - neighbourStart[nodeIndex] - 1;
+  }
+
+  bool isNeighbour( uint32_t nodeIndex, int nodeId ){
+    if( mobile ){
+      return findNeighbour( nodeIndex, nodeId ) != 0;
+    }
+    for( uint32_t j = neighbourStart[nodeIndex]; m_neighbourNode[j] != -1; j++ ){
+      if( m_neighbourNode[j] == nodeId ){
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Sends every message with exactly its serialized size instead of padding it to m_packetSize.
+  // phyMode only sets the data rate used to account the airtime of each transmission.
+  void SetFrameSizing( bool rightSized, std::string phyMode ){
+    rightSizedFrames = rightSized;
+    ofdm = phyMode.compare( 0, 4, "Ofdm" ) == 0;
+    size_t begin = phyMode.find( "Rate" ), end = phyMode.find( "Mbps" );
+    if( begin != std::string::npos && end != std::string::npos ){
+      std::string rate = phyMode.substr( begin + 4, end - begin - 4 );
+      std::replace( rate.begin(), rate.end(), '_', '.' );
+      dataRate = std::max( atof( rate.c_str() ), 1.0 );
+    }
+  }
+
+  // Channel time of one frame carrying a UDP payload: PLCP preamble and header, then the
+  // UDP/IP, LLC/SNAP and MAC header/FCS overhead at the data rate, plus SIFS and ACK if unicast.
+  Time frameAirtime( uint32_t payloadBytes, bool unicast ){
+    const uint32_t overhead = 8 + 20 + 8 + 28, ackBytes = 14;
+    double us = 0;
+    if( ofdm ){
+      us = 20 + 4 * std::ceil( ( 22 + 8.0 * ( payloadBytes + overhead ) ) / ( 4 * dataRate ) );
+      if( unicast ){
+        us += 16 + 20 + 4 * std::ceil( ( 22 + 8.0 * ackBytes ) / ( 4 * dataRate ) );
+      }
+    }else{
+      us = 192 + 8.0 * ( payloadBytes + overhead ) / dataRate;
+      if( unicast ){
+        us += 10 + 192 + 8.0 * ackBytes / dataRate;
+      }
+    }
+    return NanoSeconds( (uint64_t) ( us * 1000 ) );
+  }
+
+  void accountTransmission( WirelessNode * txNode, int msgType, Ptr<Packet> pkt, bool unicast ){
+    Time duration = frameAirtime( pkt->GetSize(), unicast );
+    txNode->addTransmission( msgType, pkt->GetSize(), duration );
+    totalAirtime += duration;
+    bytesSent += pkt->GetSize();
+    lastTransmissionEnd = std::max( lastTransmissionEnd, Simulator::Now() + duration );
+    if( capture != 0 ){
+      capture->tag( txNode->getNodeId() - 1, pkt->GetUid(), msgType );
+    }
+  }
+
+  // Bytes and channel time per message type and per node, the channel being shared by all of them
+  void printAirtimeReport( std::ostream &os ){
+    int width = 12;
+    Time span = lastTransmissionEnd - protocolStartTime;
+    os << "Airtime at " << dataRate << " Mbps" << ( rightSizedFrames ? " with right-sized frames" : "" )
+       << ": " << totalAirtime.GetSeconds() * 1e3 << " ms, channel occupancy "
+       << ( span.IsStrictlyPositive() ? totalAirtime.GetSeconds() / span.GetSeconds() : 0 ) << '\n';
+    os << std::setw(6) << "Id" << std::setw(6) << "Hop";
+    for( int m = 0; m < NUM_MSG_TYPES; m++ ){
+      os << std::setw(width) << std::string( msgTypeName(m) ) + "(B)" << std::setw(width) << std::string( msgTypeName(m) ) + "(ms)";
+    }
+    os << std::setw(width) << "Share" << '\n';
+    uint64_t typeBytes[NUM_MSG_TYPES] = { 0, 0, 0, 0, 0, 0 };
+    double typeAirtime[NUM_MSG_TYPES] = { 0, 0, 0, 0, 0, 0 };
+    for( uint32_t j=0; j< nodes.size(); j++){
+      WirelessNode * node = nodes[j];
+      double nodeAirtime = 0;
+      os << std::setw(6) << node->getNodeId() << std::setw(6) << node->getNodeHop();
+      for( int m = 0; m < NUM_MSG_TYPES; m++ ){
+        os << std::setw(width) << node->getSentBytes(m) << std::setw(width) << node->getAirtime(m).GetSeconds() * 1e3;
+        typeBytes[m] += node->getSentBytes(m);
+        typeAirtime[m] += node->getAirtime(m).GetSeconds();
+        nodeAirtime += node->getAirtime(m).GetSeconds();
+      }
+      os << std::setw(width) << ( totalAirtime.IsStrictlyPositive() ? nodeAirtime / totalAirtime.GetSeconds() : 0 ) << '\n';
+    }
+    os << std::setw(12) << "Total";
+    for( int m = 0; m < NUM_MSG_TYPES; m++ ){
+      os << std::setw(width) << typeBytes[m] << std::setw(width) << typeAirtime[m] * 1e3;
+    }
+    os << '\n';
+    os.flush();
+  }
+
+  // filtered capture: the network tells it the message type of every packet and the offset errors
+  void SetCapture( PacketCapture *packetCapture ){
+    capture = packetCapture;
+  }
+
+  // measures the wall clock time spent handling received packets
+  void SetProfiling( bool enabled ){
+    profiling = enabled;
+  }
+
+  uint32_t getMasterIndex(){
+    return masterIndex;
+  }
+
+  void getSnapshot( std::vector< NodeSnapshot > &snapshot ){
+    Time masterTime = nodes[masterIndex]->getLocalTime();
+    snapshot.clear();
+    for( uint32_t j=0; j< nodes.size(); j++){
+      snapshot.push_back( nodes[j]->getSnapshot( masterTime ) );
+    }
+  }
+
+  // Starts from the converged state of an earlier run instead of from setIntialTime: its master,
+  // sync tree and node clocks. The sync time and synced fraction of a restored run count the first
+  // exchange every node completes in this run, as lastSync starts at the protocol start for every
+  // node. Call after addNodesToNetwork and SetTransparentClock.
+  void restoreSnapshot( const std::vector< NodeSnapshot > &snapshot, uint32_t master ){
+    nodes[masterIndex]->setNodeAsMaster( false );
+    masterIndex = master;
+    nodes[masterIndex]->setNodeAsMaster();
+    Time masterTime = nodes[masterIndex]->getLocalTime();
+    restoredCorrections.assign( nodes.size(), 0 );
+    for( uint32_t j=0; j< nodes.size(); j++){
+      nodes[j]->restoreSnapshot( snapshot[j], masterTime );
+      restoredCorrections[j] = snapshot[j].numCorrections;
+      trace.markChanged( j );
+    }
+  }
+
+  // corrections of node nodeIndex in this run, not counting those of a restored snapshot
+  int correctionsInRun( uint32_t nodeIndex ){
+    int restored = restoredCorrections.empty() ? 0 : restoredCorrections[nodeIndex];
+    return nodes[nodeIndex]->getNumCorrections() - restored;
+  }
+
   void addNodesToNetwork( std::vector< WirelessNode * > &nodesInNetwork){
     nodes = nodesInNetwork;
     globalTime = NanoSeconds( Simulator::Now() );
     int j;
     nodes[masterIndex]->setNodeAsMaster();
     for( j=0; j< nodes.size(); j++){
+      nodes[j]->setLazyClock( lazyClocks );
       nodes[j]->setIntialTime( globalTime );
     }
   }
 
+  // Opens the trace; the initial state of every node is written with the first event
+  void SetTrace( int level, std::string fileName ){
+    trace.open( level, fileName, nodes.size() );
+    for( uint32_t j=0; j< nodes.size(); j++){
+      trace.markChanged( j );
+    }
+  }
+
+  void closeTrace(){
+    trace.close();
+  }
+
+  // Writes the convergence statistics every interval to fileName (stdout if empty) while the
+  // protocol is running; a zero interval only keeps the statistics for the end of the run.
+  bool SetStatistics( Time interval, std::string fileName ){
+    statsInterval = interval;
+    if( !fileName.empty() ){
+      statsFile.open( fileName.c_str() );
+      if( !statsFile.is_open() ){
+        std::cerr << "cannot open statistics file " << fileName << std::endl;
+        return false;
+      }
+      ConvergenceStats::printHeader( statsFile );
+    }
+    if( statsInterval.IsStrictlyPositive() ){
+      Simulator::Schedule( statsInterval, &WirelessNetwork::statsCheckpoint, this );
+    }
+    return true;
+  }
+
+  void statsCheckpoint(){
+    std::ostream &os = statsFile.is_open() ? statsFile : std::cout;
+    stats.print( os, Simulator::Now().GetSeconds() );
+    // stop once the last round has started and no correction happened since the last checkpoint
+    bool active = syncRound < syncRounds || stats.getNumCorrections() != correctionsAtCheckpoint;
+    correctionsAtCheckpoint = stats.getNumCorrections();
+    if( active ){
+      Simulator::Schedule( statsInterval, &WirelessNetwork::statsCheckpoint, this );
+    }
+  }
+
+  // final statistics: table and histograms to os, last row set to the statistics file
+  void printStatistics( std::ostream &os ){
+    os << "Convergence statistics over " << stats.getNumCorrections() << " corrections" << '\n';
+    ConvergenceStats::printHeader( os );
+    stats.print( os, Simulator::Now().GetSeconds() );
+    stats.printHistograms( os );
+  }
+
+  void closeStatistics(){
+    if( statsFile.is_open() ){
+      stats.print( statsFile, Simulator::Now().GetSeconds() );
+      statsFile.close();
+    }
+  }
+
+  void collectMetrics( ScenarioMetrics &metrics ){
+    Time masterTime = this->getNode(masterIndex)->getLocalTime();
+    double offsetSum = 0, offsetMax = 0, rmsSum = 0, sent = controlSent, received = controlReceived, memory = 0;
+    uint32_t failed = 0, synced = 0;
+    for( uint32_t j=0; j< nodes.size(); j++){
+      WirelessNode * node = nodes[j];
+      memory += node->getMemoryUsage();
+      for( int m = 0; m < NUM_EXCHANGE_TYPES; m++ ){
+        sent += node->getSentPacketCounter(m);
+        received += node->getReceivedPacketCounter(m);
+      }
+      if( hasFailed( node ) ){
+        failed++;
+        continue;
+      }
+      if( node->isNodeMaster() ){
+        continue;
+      }
+      synced += correctionsInRun( j ) > 0 ? 1 : 0;
+      double offset = std::abs( (double)( node->getLocalTime().GetNanoSeconds() - masterTime.GetNanoSeconds() ) );
+      offsetSum += offset;
+      offsetMax = std::max( offsetMax, offset );
+      rmsSum += node->getRmsError();
+    }
+    uint32_t slaves = nodes.size() - 1 - failed;
+    metrics.values[METRIC_SYNC_TIME] = syncedNodes == slaves ? ( allSyncedTime - protocolStartTime ).GetSeconds() : -1;
+    metrics.values[METRIC_SYNCED_FRACTION] = synced * 1.0 / slaves;
+    metrics.values[METRIC_MEAN_OFFSET] = offsetSum / slaves;
+    metrics.values[METRIC_MAX_OFFSET] = offsetMax;
+    metrics.values[METRIC_STEADY_RMS] = rmsSum / slaves;
+    metrics.values[METRIC_ERROR_P50] = stats.get( STAT_ERROR_AFTER ).quantile( 0.5 );
+    metrics.values[METRIC_ERROR_P95] = stats.get( STAT_ERROR_AFTER ).quantile( 0.95 );
+    metrics.values[METRIC_ERROR_P99] = stats.get( STAT_ERROR_AFTER ).quantile( 0.99 );
+    metrics.values[METRIC_PACKETS_SENT] = sent;
+    metrics.values[METRIC_PACKETS_RECEIVED] = received;
+    metrics.values[METRIC_BYTES_SENT] = bytesSent;
+    metrics.values[METRIC_AIRTIME] = totalAirtime.GetSeconds();
+    Time span = lastTransmissionEnd - protocolStartTime;
+    metrics.values[METRIC_CHANNEL_OCCUPANCY] = span.IsStrictlyPositive() ? totalAirtime.GetSeconds() / span.GetSeconds() : 0;
+    metrics.values[METRIC_RECEIVE_TIME] = receiveTime;
+    metrics.values[METRIC_NODE_MEMORY] = memory / nodes.size();
+    metrics.values[METRIC_ANNOUNCES] = announcesSent;
+    metrics.values[METRIC_DETECT_TIME] = failoverStarted ? ( detectionTime - failureTime ).GetSeconds() : -1;
+    metrics.values[METRIC_RESYNC_TIME] = resyncTime.IsStrictlyPositive() ? ( resyncTime - failureTime ).GetSeconds() : -1;
+    metrics.values[METRIC_OUTAGE_PEAK_OFFSET] = outagePeakOffset;
+    metrics.values[METRIC_LINK_CHANGES] = linkChanges;
+    metrics.values[METRIC_REPARENTS] = reparents;
+    metrics.values[METRIC_REPAIR_MESSAGES] = repairMessages;
+    metrics.values[METRIC_SEND_FAILURES] = sendFailures;
+    for( uint32_t j=0; j< nodes.size(); j++){
+      metrics.values[METRIC_TREE_DEPTH] = std::max( metrics.values[METRIC_TREE_DEPTH], (double) nodes[j]->getNodeHop() );
+    }
+  }
+
+  // Steady-state accuracy of every node over the periodic rounds, in local clock nanoseconds
+  void printAccuracyReport( std::ostream &os ){
+    int width = 14;
+    os << "Steady-state accuracy after " << syncRound << " rounds (first " << WirelessNode::ACCURACY_WARMUP << " corrections excluded)" << '\n';
+    os << std::setw(6) << "Id" << std::setw(6) << "Hop" << std::setw(8) << "Samples" << std::setw(width) << "MeanAbs(ns)"
+       << std::setw(width) << "Rms(ns)" << std::setw(width) << "MaxAbs(ns)" << std::setw(width) << "EstFreq(ppb)"
+       << std::setw(width) << "TrueFreq(ppb)" << '\n';
+    for( uint32_t j=0; j< nodes.size(); j++){
+      WirelessNode * node = nodes[j];
+      if( node->isNodeMaster() ){
+        continue;
+      }
+      os << std::setw(6) << node->getNodeId() << std::setw(6) << node->getNodeHop() << std::setw(8) << node->getAccuracySamples()
+         << std::setw(width) << node->getMeanAbsoluteError() << std::setw(width) << node->getRmsError()
+         << std::setw(width) << node->getMaxAbsoluteError() << std::setw(width) << node->getEstimatedFrequencyError() * 1e9
+         << std::setw(width) << ( node->getError() - 1 ) * 1e9 << '\n';
+    }
+    os.flush();
+  }
+
   WirelessNode * getNode(int index){
     return nodes[index];
   }
 
 
+  NodeTraceRow traceRowOf( WirelessNode * node ){
+    NodeTraceRow row;
+    row.time = globalTime.GetNanoSeconds();
+    row.nodeId = node->getNodeId();
+    row.isMaster = node->isNodeMaster();
+    row.clockError = node->getError();
+    row.state = node->getState();
+    row.localTime = node->getLocalTime().GetNanoSeconds();
+    row.offset = node->getOffset().GetNanoSeconds();
+    row.oldOffsetError = node->getOldOffsetError();
+    row.newOffsetError = node->getNewOffsetError();
+    row.synchronizationTime = node->getSynchronizationTime().GetNanoSeconds();
+    for( int m = 0; m < 4; m++ ){
+      row.sent[m] = node->getSentPacketCounter(m);
+      row.received[m] = node->getReceivedPacketCounter(m);
+    }
+    row.ratePpb = node->getRatePpb();
+    return row;
+  }
+
+  // Records a protocol event in the trace: the event itself and every node changed since the
+  // previous one. At TRACE_TABLE the full clock table of all nodes is printed as well.
   void printClockValuesOfNodes(Ipv4Address senderIp, Ipv4Address receiverIp, uint16_t senderHop, 
     std::string msgType, Time dreqAtMaster, Time syncSendTime, int id){
-    int nodeId, state, syncSent, syncRecv, followSent, followRecv, dreqSent, dreqRecv, dreplySent, dreplyRecv, width = 12;
-    Time clockTime, clockOffset, presentOffset, synchronizationTime;
-    std::string nodeState;
-    double oldOffsetError, newOffsetError, clockError;
-
-    std::cout << " -----------------------------------------------------------------------------------------------------------------------------------------------" << std::endl;
-    std::cout << "  Sender : " << senderIp << "          Receiver : " << receiverIp << std::endl;
-    std::cout << "  Sender-Hop-Number : " << senderHop << "      MSG_TYPE : " << msgType << "      Id : " << id << std::endl;
-    std::cout << "  dreqAtMaster :" << std::setw(width) << dreqAtMaster.GetNanoSeconds() << 
-                       " syncSendTime : " << std::setw(width) << syncSendTime.GetNanoSeconds() << std::endl;
-    std::cout<<"Id => ClockDev. => ErrBeforeSync => ErrAfterSync => Time => State => Curr.Offset => Calc.Offset => Synchronization Time => Sync  => Follow  => Dreq => Drply "<<std::endl;
-    
-    for(int j=0;j<m_users;j++){
-      
-      nodeId = j+1;
-      clockTime = this->getNode(j)->getLocalTime();
-      state = this->getNode(j)->getState();
-      syncSent = this->getNode(j)->getSentPacketCounter(SYNC);
-      syncRecv = this->getNode(j)->getReceivedPacketCounter(SYNC);
-      followSent = this->getNode(j)->getSentPacketCounter(FOLLOW);
-      followRecv = this->getNode(j)->getReceivedPacketCounter(FOLLOW);
-      dreqSent = this->getNode(j)->getSentPacketCounter(DREQ);
-      dreqRecv = this->getNode(j)->getReceivedPacketCounter(DREQ);
-      dreplySent = this->getNode(j)->getSentPacketCounter(DRPLY);
-      dreplyRecv = this->getNode(j)->getReceivedPacketCounter(DRPLY);
-      clockError = this->getNode(j)->getError();
-      switch( state ){
-        case 0: nodeState = "INACTIVE";
-                break;
-        case 1: nodeState = "ACTIVE";
-                break;
-        case 2: nodeState = "WAITING";
-                break;
-        case 3: nodeState = "SYNCED";
-                break;
-      }
+    if( trace.getLevel() == TRACE_OFF ){
+      return;
+    }
+    std::stringstream senderStream, receiverStream;
+    senderStream << senderIp;
+    receiverStream << receiverIp;
+
+    TraceEventRow event;
+    event.time = globalTime.GetNanoSeconds();
+    event.id = id;
+    event.msgType = msgType;
+    event.senderHop = senderHop;
+    event.senderIp = senderStream.str();
+    event.receiverIp = receiverStream.str();
+    event.dreqAtMaster = dreqAtMaster.GetNanoSeconds();
+    event.syncSendTime = syncSendTime.GetNanoSeconds();
+    event.masterTime = this->getNode(masterIndex)->getLocalTime().GetNanoSeconds();
+    trace.recordEvent( event );
+
+    std::vector< uint32_t > &changedNodes = trace.getChangedNodes();
+    for( size_t j = 0; j < changedNodes.size(); j++ ){
+      trace.recordNode( traceRowOf( nodes[ changedNodes[j] ] ) );
+    }
+    trace.clearChanged();
 
-      presentOffset = NanoSeconds( clockTime.GetNanoSeconds() - this->getNode(masterIndex)->getLocalTime().GetNanoSeconds() );
-      
-      if( state == 3 ){
-        clockOffset = this->getNode(j)->getOffset();
-        oldOffsetError = this->getNode(j)->getOldOffsetError();
-        newOffsetError = this->getNode(j)->getNewOffsetError();
-        synchronizationTime = this->getNode(j)->getSynchronizationTime();
-        std::cout << std::setw(2) << nodeId << "   " << std::setw(6) << clockError << "   " << std::setw(width) << oldOffsetError << "    " << std::setw(width) << newOffsetError << "    " << std::setw(width) << clockTime.GetNanoSeconds() << "   " << std::setw(width) << nodeState << "   "<< std::setw(width) << presentOffset.GetNanoSeconds() << "   " << std::setw(width) << clockOffset.GetNanoSeconds() << "     " <<  synchronizationTime.GetNanoSeconds() << "     " << std::setw(2) << syncSent << "   " << std::setw(2) << syncRecv << std::setw(2) << "   " << followSent << std::setw(2) << "   " << followRecv << std::setw(2) << "   " << dreqSent << std::setw(2) << "   " << dreqRecv << std::setw(2) << "   " << dreplySent << std::setw(2) << "   " << dreplyRecv << std::endl;  
-      }else{
-        std::cout << std::setw(2) << nodeId << "   " << std::setw(6) << clockError << "   "  << std::setw(width) <<  "N/A"        << "    " << std::setw(width) << "N/A"          << "    " << std::setw(width) << clockTime.GetNanoSeconds() << "   " << std::setw(width) << nodeState << "   "<< std::setw(width) << presentOffset.GetNanoSeconds() << "   " << std::setw(width) << "N/A"                        << "     " <<  "N/A"                                << "     " << std::setw(2) << syncSent << "   " << std::setw(2) << syncRecv << std::setw(2) << "   " << followSent << std::setw(2) << "   " << followRecv << std::setw(2) << "   " << dreqSent << std::setw(2) << "   " << dreqRecv << std::setw(2) << "   " << dreplySent << std::setw(2) << "   " << dreplyRecv << std::endl;
+    if( trace.getLevel() >= TRACE_TABLE ){
+      std::vector< NodeTraceRow > rows;
+      for(int j=0;j<m_users;j++){
+        rows.push_back( traceRowOf( this->getNode(j) ) );
       }
-      
+      ClockTrace::printTable( std::cout, event, rows );
     }
-    std::cout<<"-------------------------------------------------------------------------------------------------------------------------------------------------" << std::endl;
-    std::cout << std::endl;
-    std::cout << std::endl;
   }
 
-
+  // Eager mode only: re-anchors every clock at globalTime. Lazy clocks are evaluated on demand
+  // by WirelessNode::getLocalTime, see WirelessNode::setLazyClock for how far the two differ.
   void setLocalTimeAtNodes(){
+    if( lazyClocks ){
+      return;
+    }
 
     for(int j=0; j< nodes.size(); j++){
       nodes[j]->setLocalTime( globalTime );
@@ -545,177 +2801,856 @@ public:
   }
 
 
+  // Runtime master election: instead of the master and tree given to the nodes, every node starts
+  // as its own grandmaster and the ANNOUNCEs elect the best clock and build a minimum-hop tree to
+  // it. A node forwards an ANNOUNCE only when it improves what the node knows, and announces itself
+  // only if it has heard of nothing better by its turn: nodes with a priority better than the
+  // default right away, the others slot * id later, when the flood of a better clock normally has
+  // reached them. So in the usual case every node announces once, O(E) messages. Call after
+  // addNodesToNetwork and SetBroadcast; startElection runs it before the protocol, the failover
+  // runs it again when the master is lost.
+  void SetElection( const std::vector< uint8_t > &priorities, Time slot, Time duration ){
+    electionSlot = slot;
+    electionTime = duration;
+    priority = priorities;
+    bmc.resize( nodes.size() );
+    for( uint32_t j=0; j< nodes.size(); j++){
+      bmc[j] = BmcDataset( 0, priorities[j], j+1, 0, j+1 );
+    }
+    announcePending.assign( nodes.size(), 0 );
+    inSyncTree.assign( nodes.size(), true );
+    alive.assign( nodes.size(), true );
+  }
+
+  void startElection(){
+    election = true;
+    for( uint32_t j=0; j< nodes.size(); j++){
+      startCandidacy( j, 0 );
+    }
+  }
+
+  // the node forgets the clocks it knew and waits for its turn to announce itself in this epoch
+  void startCandidacy( uint32_t nodeIndex, uint32_t epoch ){
+    bmc[nodeIndex] = BmcDataset( epoch, priority[nodeIndex], nodeIndex+1, 0, nodeIndex+1 );
+    Time delay = priority[nodeIndex] < DEFAULT_PRIORITY ? Seconds (0) : NanoSeconds( electionSlot.GetNanoSeconds() * ( nodeIndex+1 ) );
+    Simulator::Schedule( delay, &WirelessNetwork::announceSelf, this, nodeIndex, epoch );
+  }
+
+  void announceSelf( uint32_t nodeIndex, uint32_t epoch ){
+    if( alive[nodeIndex] && bmc[nodeIndex].epoch == epoch && bmc[nodeIndex].grandmasterId == nodeIndex + 1 ){
+      sendAnnounce( nodeIndex );
+    }
+  }
+
+  // Sends the best clock the node knows to its neighbours, in unicast mode not back to its parent
+  void sendAnnounce( uint32_t nodeIndex ){
+    announcePending[nodeIndex] = 0;
+    WirelessNode * txNode = nodes[nodeIndex];
+    const BmcDataset &best = bmc[nodeIndex];
+    txHeader.setSenderId( txNode->getNodeId() );
+    txHeader.setGrandmaster( best.grandmasterId, best.priority );
+    txHeader.setHop( best.stepsRemoved );
+    txHeader.setMsgType( ANNOUNCE );
+    txHeader.setEventId( best.epoch );
+    txHeader.setDreqAtMaster( NanoSeconds (0) );
+    txHeader.setSyncSendTime( NanoSeconds (0) );
+    txHeader.setTimeStampCount( 0 );
+    uint32_t headerSize = txHeader.GetSerializedSize();
+    Ptr<Packet> pkt = Create<Packet>( !rightSizedFrames && m_packetSize > headerSize ? m_packetSize - headerSize : 0 );
+    pkt->AddHeader( txHeader );
+    if( broadcast ){
+      transmit( socketsInNetwork[nodeIndex]->getSocket(), pkt );
+      accountTransmission( txNode, ANNOUNCE, pkt, false );
+      announcesSent++;
+    }
+    for( int j = 0; !broadcast && j < txNode->getNumNeighbour(); j++ ){
+      SocketPoint * point = socketsInNetwork[txNode->getNeighbour(j)];
+      if( point->getRecvId() != best.parentId ){
+        transmit( point->getSocket(), pkt );
+        accountTransmission( txNode, ANNOUNCE, pkt, true );
+        announcesSent++;
+      }
+    }
+    txNode->incrementSentPacketCounter(ANNOUNCE);
+    controlSent++;
+  }
+
+  // Takes the announced clock if it beats the node's best and forwards it after a short hold, so
+  // that better offers arriving meanwhile go out in the same ANNOUNCE. Between equal offers the
+  // parent the node already has in the sync tree wins, so a new election keeps what it can of the
+  // old tree, and a change of parent alone is not announced.
+  void processAnnounce( uint32_t nodeIndex, uint32_t senderId ){
+    BmcDataset offer( rxHeader.getEventId(), rxHeader.getGrandmasterPriority(), rxHeader.getGrandmasterId(), rxHeader.getHop() + 1, senderId );
+    nodes[nodeIndex]->incrementReceivedPacketCounter(ANNOUNCE);
+    controlReceived++;
+    if( offer.epoch > bmc[nodeIndex].epoch ){
+      startCandidacy( nodeIndex, offer.epoch );
+    }
+    BmcDataset &best = bmc[nodeIndex];
+    uint32_t treeParent = nodes[nodeIndex]->getMasterId();
+    bool better = offer.isBetterThan( best );
+    if( offer.sameClock( best ) && offer.stepsRemoved == best.stepsRemoved ){
+      better = senderId == treeParent || ( better && best.parentId != treeParent );
+    }
+    if( !better ){
+      return;
+    }
+    bool changed = !offer.sameClock( best ) || offer.stepsRemoved != best.stepsRemoved;
+    best = offer;
+    if( changed && !announcePending[nodeIndex] ){
+      announcePending[nodeIndex] = 1;
+      Simulator::Schedule( MilliSeconds (1), &WirelessNetwork::sendAnnounce, this, nodeIndex );
+    }
+  }
+
+  // Ends the election: the grandmaster chosen by most nodes becomes the master and every node
+  // that chose it takes its parent and hop from the election. Nodes that ended up with another
+  // grandmaster (a partitioned network, or an election cut short) stay out of the protocol.
+  void applyElection(){
+    std::map< uint32_t, uint32_t > votes;
+    uint32_t grandmaster = masterIndex + 1;
+    votes[grandmaster] = 0;
+    for( uint32_t j=0; j< nodes.size(); j++){
+      if( !alive[j] ){
+        continue;
+      }
+      uint32_t count = ++votes[ bmc[j].grandmasterId ];
+      if( count > votes[grandmaster] || ( count == votes[grandmaster] && bmc[j].grandmasterId < grandmaster ) ){
+        grandmaster = bmc[j].grandmasterId;
+      }
+    }
+    nodes[masterIndex]->setNodeAsMaster( false );
+    masterIndex = grandmaster - 1;
+    treeEpoch = bmc[masterIndex].epoch;
+    treeDepth = 0;
+    for( uint32_t j=0; j< nodes.size(); j++){
+      inSyncTree[j] = alive[j] && bmc[j].grandmasterId == grandmaster;
+      if( inSyncTree[j] ){
+        nodes[j]->setSyncTree( bmc[j].parentId, bmc[j].stepsRemoved );
+        treeDepth = std::max( treeDepth, (uint32_t) bmc[j].stepsRemoved );
+      }
+      trace.markChanged( j );
+    }
+    nodes[masterIndex]->setNodeAsMaster( true );
+  }
+
+  // Master failure: at failTime the current master stops, it neither sends nor handles packets
+  // any more. Every node expects a completed sync exchange every sync interval; after timeout
+  // intervals without one it goes into holdover, keeping the rate its servo last set, and starts a
+  // new election epoch, so its ANNOUNCEs make the nodes they reach drop the lost master as well.
+  // electionTime after the first detection the elected backup becomes the master and the periodic
+  // rounds go on from it. Call after SetElection and SetPeriodicSync.
+  void SetMasterFailure( Time failTime, uint32_t timeout ){
+    syncTimeout = timeout;
+    lastSync.assign( nodes.size(), NanoSeconds (0) );
+    needsResync.assign( nodes.size(), false );
+    if( failTime.IsStrictlyPositive() ){
+      Simulator::Schedule( failTime, &WirelessNetwork::failMaster, this );
+    }
+  }
+
+  void failMaster(){
+    alive[masterIndex] = false;
+    failureTime = Simulator::Now();
+    nodes[masterIndex]->setState(INACTIVE);
+    trace.markChanged( masterIndex );
+  }
+
+  // Broadcast frames are neither acknowledged nor retried, and a failed node never receives, so an
+  // event of the sequencer can wait forever for a packet. This check runs every timeout while the
+  // protocol runs and gives up on an event that has not moved since the previous check. Started
+  // by startProtocol in broadcast mode and with failure detection.
+  void SetStallTimeout( Time timeout ){
+    stallTimeout = timeout;
+  }
+
+  void checkStall(){
+    if( sequencer.getCurrentId() == stallEventId && sequencer.expire() ){
+      releaseParkedSends();
+    }
+    stallEventId = sequencer.getCurrentId();
+    if( syncRound < syncRounds || sequencer.hasParked() ){
+      Simulator::Schedule( stallTimeout, &WirelessNetwork::checkStall, this );
+    }
+  }
+
+  // Runs every sync interval: detects nodes that lost their master and samples the offsets during
+  // an outage
+  void watchdog(){
+    Time now = Simulator::Now();
+    Time limit = NanoSeconds( syncInterval.GetNanoSeconds() * syncTimeout );
+    int64_t reference = now.GetNanoSeconds() / 5;
+    for( uint32_t j=0; j< nodes.size(); j++){
+      if( !alive[j] || !inSyncTree[j] || j == masterIndex ){
+        continue;
+      }
+      if( nodes[j]->getState() != HOLDOVER && now - lastSync[j] > limit ){
+        detectMasterLoss( j );
+      }
+      if( isInOutage() ){
+        outagePeakOffset = std::max( outagePeakOffset, std::abs( (double)( nodes[j]->localTimeAt( now ).GetNanoSeconds() - reference ) ) );
+      }
+    }
+    if( syncRound < syncRounds ){
+      Simulator::Schedule( syncInterval, &WirelessNetwork::watchdog, this );
+    }
+  }
+
+  void detectMasterLoss( uint32_t nodeIndex ){
+    nodes[nodeIndex]->setState(HOLDOVER);
+    trace.markChanged( nodeIndex );
+    if( !failoverStarted ){
+      failoverStarted = true;
+      detectionTime = Simulator::Now();
+      Simulator::Schedule( electionTime, &WirelessNetwork::finishFailover, this );
+    }
+    // one failover per run: a node that has not heard of the new epoch yet starts it
+    if( !failoverApplied && bmc[nodeIndex].epoch == treeEpoch ){
+      startCandidacy( nodeIndex, treeEpoch + 1 );
+    }
+  }
+
+  // the backup takes over: its clock becomes the reference and every node of the new tree has
+  // to complete an exchange with it before the failover counts as done
+  void finishFailover(){
+    failoverApplied = true;
+    applyElection();
+    resyncPending = 0;
+    for( uint32_t j=0; j< nodes.size(); j++){
+      needsResync[j] = inSyncTree[j] && j != masterIndex;
+      resyncPending += needsResync[j] ? 1 : 0;
+    }
+  }
+
+  bool isInOutage(){
+    return failureTime.IsStrictlyPositive() && ( resyncPending > 0 || !resyncTime.IsStrictlyPositive() );
+  }
+
+  // a node completed an exchange: it has a master, and the failover is done when all have
+  void noteSync( uint32_t nodeIndex, double errorBefore ){
+    lastSync[nodeIndex] = Simulator::Now();
+    if( mobile && movedAt[nodeIndex].IsStrictlyPositive() ){
+      movedResyncSum += ( Simulator::Now() - movedAt[nodeIndex] ).GetSeconds();
+      movedResyncSamples++;
+      movedAt[nodeIndex] = NanoSeconds (0);
+    }
+    if( syncTimeout == 0 ){
+      return;
+    }
+    if( isInOutage() ){
+      outagePeakOffset = std::max( outagePeakOffset, errorBefore );
+    }
+    if( needsResync[nodeIndex] ){
+      needsResync[nodeIndex] = false;
+      if( --resyncPending == 0 ){
+        resyncTime = Simulator::Now();
+      }
+    }
+  }
+
+  void printFailoverReport( std::ostream &os ){
+    if( !failureTime.IsStrictlyPositive() ){
+      return;
+    }
+    os << "Master failure at " << failureTime.GetSeconds() << " s: ";
+    if( !failoverStarted ){
+      os << "not detected" << '\n';
+      return;
+    }
+    os << "detected after " << ( detectionTime - failureTime ).GetSeconds() << " s, new master " << masterIndex + 1;
+    if( resyncTime.IsStrictlyPositive() ){
+      os << ", all nodes resynchronized after " << ( resyncTime - failureTime ).GetSeconds() << " s";
+    }else{
+      os << ", " << resyncPending << " nodes not resynchronized";
+    }
+    os << ", peak offset during the outage " << outagePeakOffset << " ns" << '\n';
+    os.flush();
+  }
+
+  // Mobility: the neighbours of a node are no longer the links of the topology but the nodes it
+  // has heard a HELLO from within the last loss intervals; every node broadcasts one each interval.
+  // The sync tree is repaired locally. A node that loses its parent detaches: it advertises the
+  // DETACHED hop at once, which detaches its children in turn, so exactly the orphaned subtree
+  // learns of the break. After a short hold, when that has spread, each orphan attaches to its
+  // nearest neighbour outside the subtree. A node whose parent's hop changed, or that hears of a
+  // shorter path, takes the new hop and tells its children. The cost of a change is proportional to
+  // the subtree it moves, and the moved nodes resynchronize in the next round. Needs broadcast mode;
+  // call after SetElection.
+  void SetMobility( Time interval, uint32_t loss ){
+    mobile = true;
+    helloInterval = interval;
+    helloLoss = loss;
+    repairHold = NanoSeconds( interval.GetNanoSeconds() / 20 );
+    neighbourTable.assign( nodes.size(), std::vector< NeighbourEntry >() );
+    for( uint32_t j=0; j< nodes.size(); j++){
+      for( uint32_t k = neighbourStart[j]; m_neighbourNode[k] != -1; k++ ){
+        neighbourTable[j].push_back( NeighbourEntry( m_neighbourNode[k], Simulator::Now() ) );
+      }
+    }
+    orphanSince.assign( nodes.size(), NanoSeconds (0) );
+    movedAt.assign( nodes.size(), NanoSeconds (0) );
+    for( uint32_t j=0; j< nodes.size(); j++){
+      Simulator::Schedule( NanoSeconds( interval.GetNanoSeconds() * j / nodes.size() ), &WirelessNetwork::sendHello, this, j, true );
+    }
+  }
+
+  NeighbourEntry * findNeighbour( uint32_t nodeIndex, uint32_t nodeId ){
+    std::vector< NeighbourEntry > &table = neighbourTable[nodeIndex];
+    for( uint32_t k=0; k< table.size(); k++){
+      if( table[k].id == nodeId ){
+        return &table[k];
+      }
+    }
+    return 0;
+  }
+
+  // Periodic HELLOs first drop the neighbours not heard for loss intervals, triggered ones carry a
+  // change of the node's place in the tree
+  void sendHello( uint32_t nodeIndex, bool periodic ){
+    if( !alive[nodeIndex] ){
+      return;
+    }
+    WirelessNode * txNode = nodes[nodeIndex];
+    if( periodic ){
+      if( syncRound < syncRounds ){
+        Simulator::Schedule( helloInterval, &WirelessNetwork::sendHello, this, nodeIndex, true );
+      }
+      Time deadline = Simulator::Now() - NanoSeconds( helloInterval.GetNanoSeconds() * helloLoss );
+      bool lostParent = false;
+      std::vector< NeighbourEntry > &table = neighbourTable[nodeIndex];
+      for( uint32_t k=0; k< table.size(); ){
+        if( table[k].lastHeard < deadline ){
+          lostParent = lostParent || table[k].id == txNode->getMasterId();
+          table[k] = table.back();
+          table.pop_back();
+          linkChanges++;
+        }else{
+          k++;
+        }
+      }
+      if( lostParent && inSyncTree[nodeIndex] && nodeIndex != masterIndex ){
+        detach( nodeIndex );
+        return;
+      }
+    }else{
+      repairMessages++;
+    }
+    bool attached = inSyncTree[nodeIndex];
+    txHeader.setSenderId( txNode->getNodeId() );
+    txHeader.setReceiverId( attached ? txNode->getMasterId() : 0 );
+    txHeader.setHop( attached ? txNode->getNodeHop() : DETACHED );
+    txHeader.setMsgType( HELLO );
+    txHeader.setEventId( 0 );
+    txHeader.setDreqAtMaster( NanoSeconds (0) );
+    txHeader.setSyncSendTime( NanoSeconds (0) );
+    txHeader.setCorrection( NanoSeconds (0) );
+    txHeader.setTimeStampCount( 0 );
+    uint32_t headerSize = txHeader.GetSerializedSize();
+    Ptr<Packet> pkt = Create<Packet>( !rightSizedFrames && m_packetSize > headerSize ? m_packetSize - headerSize : 0 );
+    pkt->AddHeader( txHeader );
+    transmit( socketsInNetwork[nodeIndex]->getSocket(), pkt );
+    accountTransmission( txNode, HELLO, pkt, false );
+    txNode->incrementSentPacketCounter(HELLO);
+    controlSent++;
+  }
+
+  void processHello( uint32_t nodeIndex, uint32_t senderId ){
+    NeighbourEntry * entry = findNeighbour( nodeIndex, senderId );
+    if( entry == 0 ){
+      neighbourTable[nodeIndex].push_back( NeighbourEntry( senderId, Simulator::Now() ) );
+      entry = &neighbourTable[nodeIndex].back();
+      linkChanges++;
+    }
+    entry->hop = rxHeader.getHop();
+    entry->parentId = rxHeader.getReceiverId();
+    entry->lastHeard = Simulator::Now();
+    WirelessNode * node = nodes[nodeIndex];
+    node->incrementReceivedPacketCounter(HELLO);
+    controlReceived++;
+    if( nodeIndex == masterIndex ){
+      return;
+    }
+    if( !inSyncTree[nodeIndex] ){
+      if( !orphanSince[nodeIndex].IsStrictlyPositive() || Simulator::Now() - orphanSince[nodeIndex] >= repairHold ){
+        tryAttach( nodeIndex );
+      }
+      return;
+    }
+    uint32_t hop = entry->hop;
+    if( senderId == node->getMasterId() ){
+      // a hop beyond the number of nodes can only come from a loop, which breaks it
+      if( hop == DETACHED || hop + 1 > nodes.size() ){
+        detach( nodeIndex );
+      }else if( hop + 1 != node->getNodeHop() ){
+        moveInTree( nodeIndex, senderId, hop + 1 );
+      }
+    }else if( hop != DETACHED && entry->parentId != node->getNodeId() && hop + 1 < node->getNodeHop() ){
+      moveInTree( nodeIndex, senderId, hop + 1 );
+    }
+  }
+
+  void detach( uint32_t nodeIndex ){
+    inSyncTree[nodeIndex] = false;
+    orphanSince[nodeIndex] = Simulator::Now();
+    nodes[nodeIndex]->setState(INACTIVE);
+    trace.markChanged( nodeIndex );
+    sendHello( nodeIndex, false );
+    Simulator::Schedule( repairHold, &WirelessNetwork::tryAttach, this, nodeIndex );
+  }
+
+  // joins the nearest neighbour that is attached and not a child of this node
+  void tryAttach( uint32_t nodeIndex ){
+    if( inSyncTree[nodeIndex] || !alive[nodeIndex] ){
+      return;
+    }
+    NeighbourEntry * best = 0;
+    std::vector< NeighbourEntry > &table = neighbourTable[nodeIndex];
+    for( uint32_t k=0; k< table.size(); k++){
+      if( table[k].hop == DETACHED || table[k].parentId == nodeIndex + 1 || table[k].hop + 1u > nodes.size() ){
+        continue;
+      }
+      if( best == 0 || table[k].hop < best->hop || ( table[k].hop == best->hop && table[k].id < best->id ) ){
+        best = &table[k];
+      }
+    }
+    if( best != 0 ){
+      inSyncTree[nodeIndex] = true;
+      orphanSince[nodeIndex] = NanoSeconds (0);
+      moveInTree( nodeIndex, best->id, best->hop + 1 );
+    }
+  }
+
+  void moveInTree( uint32_t nodeIndex, uint32_t parentId, uint16_t hop ){
+    if( parentId != nodes[nodeIndex]->getMasterId() ){
+      reparents++;
+    }
+    nodes[nodeIndex]->setSyncTree( parentId, hop );
+    movedAt[nodeIndex] = Simulator::Now();
+    trace.markChanged( nodeIndex );
+    sendHello( nodeIndex, false );
+  }
+
+  void printMobilityReport( std::ostream &os ){
+    uint32_t detached = 0;
+    for( uint32_t j=0; j< inSyncTree.size(); j++){
+      detached += inSyncTree[j] ? 0 : 1;
+    }
+    os << "Mobility: " << linkChanges << " link changes, " << reparents << " re-parentings, "
+       << repairMessages << " repair messages, " << detached << " nodes detached at the end";
+    if( movedResyncSamples > 0 ){
+      os << ", moved nodes resynchronized after " << movedResyncSum / movedResyncSamples << " s on average";
+    }
+    os << '\n';
+    os.flush();
+  }
+
+  void printElectionReport( std::ostream &os ){
+    uint32_t outside = 0;
+    for( uint32_t j=0; j< inSyncTree.size(); j++){
+      outside += inSyncTree[j] ? 0 : 1;
+    }
+    os << "Election: grandmaster " << masterIndex + 1 << ", tree depth " << treeDepth << ", "
+       << announcesSent << " announce messages, " << outside << " nodes outside the tree" << '\n';
+    os.flush();
+  }
+
+  // Periodic mode: the master starts a new round every interval, rounds times in total, and
+  // every node disciplines its clock with a PI servo instead of stepping it
+  void SetPeriodicSync( uint32_t rounds, Time interval, double kp, double ki ){
+    syncRounds = rounds;
+    syncInterval = interval;
+    for( uint32_t j=0; j< nodes.size(); j++){
+      nodes[j]->setServo( rounds > 1, kp, ki );
+    }
+  }
+
   void startProtocol(){
-    uint8_t i;
+    uint32_t i;
     Ptr<Socket> socketToNeighbour;
+    if( election && syncRound == 0 ){
+      applyElection();
+    }
     WirelessNode * master = this->getNode(masterIndex);
+    if( syncRound == 0 ){
+      protocolStartTime = Simulator::Now();
+      for( i = 0; i < lastSync.size(); i++ ){
+        lastSync[i] = protocolStartTime;
+      }
+      if( syncTimeout > 0 ){
+        Simulator::Schedule( syncInterval, &WirelessNetwork::watchdog, this );
+      }
+      if( ( broadcast || syncTimeout > 0 ) && stallTimeout.IsStrictlyPositive() ){
+        Simulator::Schedule( stallTimeout, &WirelessNetwork::checkStall, this );
+      }
+    }
+    syncRound++;
+    if( syncRound < syncRounds ){
+      Simulator::Schedule( syncInterval, &WirelessNetwork::startProtocol, this );
+    }
+    // a failed master misses its rounds until the backup takes over
+    if( !alive.empty() && !alive[masterIndex] ){
+      return;
+    }
     master->setState(SYNCED);
     // Sync and Follow Packet  
-    for( i = 0 ; i < master->getNumNeighbour(); i++){
+    if( broadcast ){
+      Simulator::Schedule( slotted ? reserveSlot( master ) : m_interPacketInterval, &WirelessNetwork::sendSyncFollowPacket, this, master,
+        socketsInNetwork[masterIndex]->getSocket(), eventId );
+    }
+    for( i = 0 ; !broadcast && i < master->getNumNeighbour(); i++){
       socketToNeighbour = socketsInNetwork[master->getNeighbour(i)]->getSocket();
-      Simulator::Schedule( m_interPacketInterval, &WirelessNetwork::sendSyncFollowPacket, this, master,
+      Simulator::Schedule( slotted ? reserveSlot( master ) : m_interPacketInterval, &WirelessNetwork::sendSyncFollowPacket, this, master,
         socketToNeighbour, eventId );
     }
     eventId++;
   }
 
+  // Fills the reusable transmit header and wraps it in a packet padded to m_packetSize,
+  // or exactly as large as the header with right-sized frames
+  Ptr<Packet> composePacket(WirelessNode * txNode, int msgType, int id, bool withTimeStamps){
+    txHeader.setSenderId( txNode->getNodeId() );
+    // slotted exchanges follow the sync tree: a DREQ is addressed to the parent, a DRPLY to the child that asked
+    txHeader.setReceiverId( !slotted ? 0 : msgType == DREQ ? txNode->getMasterId() : replyTo );
+    txHeader.setHop( txNode->getNodeHop() );
+    txHeader.setMsgType( msgType );
+    txHeader.setEventId( id );
+    txHeader.setDreqAtMaster( txNode->getDreqAtMaster() );
+    txHeader.setSyncSendTime( txNode->getSyncSendTime() );
+    txHeader.setCorrection( transparentClock && msgType == DRPLY ? txNode->getDownstreamCorrection() : NanoSeconds (0) );
+
+    int vectorSize = withTimeStamps && !transparentClock ? txNode->getTimeVectorSize() : 0;
+    txHeader.setTimeStampCount( vectorSize );
+    for( int m=0; m < vectorSize; m++){
+      txHeader.setTimeStamp( m, txNode->getTimeStamp(m) );
+    }
+
+    uint32_t headerSize = txHeader.GetSerializedSize();
+    Ptr<Packet> pkt = Create<Packet>( !rightSizedFrames && m_packetSize > headerSize ? m_packetSize - headerSize : 0 );
+    pkt->AddHeader( txHeader );
+    return pkt;
+  }
+
   void sendSyncFollowPacket(WirelessNode * txNode, Ptr<Socket> socket, int id ){
-    std::cout << "sendSyncFollowPacket  id ->" << id << "  eventCounterIndex->" << eventCounterIndex << std::endl;
-    if( id == eventCounterIndex ){
-    std::stringstream msgx, msgy;
+    if( trace.getLevel() >= TRACE_TABLE ){
+      std::cout << "sendSyncFollowPacket  id ->" << id << "  currentEventId->" << sequencer.getCurrentId() << '\n';
+    }
+    if( !sequencer.isReleased( id ) ){
+      sequencer.park( id, ParkedSend( SYNC, txNode, socket, id ) );
+      return;
+    }
+    if( isSilent( txNode ) ){
+      dropSend( id );
+      return;
+    }
+    trace.markChanged( txNode->getNodeId() - 1 );
 
-    // Sending the SYNC packet 
-    
-    msgx << txNode->getNodeId() << '#' << 0 << '#' << txNode->getNodeHop() << '#' << SYNC << '#' 
-    << id << '#' << txNode->getDreqAtMaster().GetNanoSeconds() << '#' 
-    << txNode->getSyncSendTime().GetNanoSeconds();
-    
-    Ptr<Packet> sync_pkt = Create<Packet>((uint8_t*) msgx.str().c_str(), m_packetSize);
-    socket->Send ( sync_pkt );
-    eventCounter[id]++;
+    // Sending the SYNC packet, a one-step clock puts its send time into the SYNC itself
+    if( oneStep ){
+      globalTime = NanoSeconds(Simulator::Now());
+      setLocalTimeAtNodes();
+      txNode->setSyncSendTime( txNode->getLocalTime() );
+    }
+    Ptr<Packet> sync_pkt = composePacket( txNode, SYNC, id, false );
+    bool stampAtPhy = phyStamps.isEnabled() && !oneStep;
+    if( stampAtPhy ){
+      awaitTxBegin( sync_pkt, ParkedSend( SYNC, txNode, socket, id ) );
+    }
+    transmit( socket, sync_pkt );
+    accountTransmission( txNode, SYNC, sync_pkt, !broadcast );
+    sequencer.addPacket( id, broadcast ? numNeighboursOf( txNode->getNodeId() - 1 ) : 1 );
     globalTime = NanoSeconds(Simulator::Now());       
     setLocalTimeAtNodes();
-    txNode->setSyncSendTime( txNode->getLocalTime() );
-    std::cout << "sending sync packet" << std::endl;
+    if( !oneStep && !stampAtPhy ){
+      txNode->setSyncSendTime( txNode->getLocalTime() );
+    }
+    if( trace.getLevel() >= TRACE_TABLE ){
+      std::cout << "sending sync packet" << '\n';
+    }
     txNode->incrementSentPacketCounter(SYNC);
-    
-    // Sending the FOLLOW_UP packet
-    
-    msgy <<  txNode->getNodeId() << '#' << 0 << '#' << txNode->getNodeHop() << '#' << FOLLOW << '#' 
-    << id << '#' << txNode->getDreqAtMaster().GetNanoSeconds() << '#' 
-    << txNode->getSyncSendTime().GetNanoSeconds() ;
+    if( oneStep ){
+      return;
+    }
+    // the FOLLOW belongs to this event even if it is sent later from finishTxStamp
+    sequencer.addPacket( id, broadcast ? numNeighboursOf( txNode->getNodeId() - 1 ) : 1 );
+    if( !stampAtPhy ){
+      sendFollowPacket( txNode, socket, id );
+    }
+  }
 
-    Ptr<Packet> follow_pkt = Create<Packet>((uint8_t*) msgy.str().c_str(), m_packetSize);
-    socket->Send ( follow_pkt );  
-    eventCounter[id]++;
+  // Sending the FOLLOW_UP packet, counted in the sequencer together with its SYNC
+  void sendFollowPacket(WirelessNode * txNode, Ptr<Socket> socket, int id ){
+    Ptr<Packet> follow_pkt = composePacket( txNode, FOLLOW, id, false );
+    transmit( socket, follow_pkt );  
+    accountTransmission( txNode, FOLLOW, follow_pkt, !broadcast );
     globalTime = NanoSeconds(Simulator::Now());       
     setLocalTimeAtNodes();
     txNode->incrementSentPacketCounter(FOLLOW);     
-    }
   }
 
  Ptr<Packet> composeDreqPacket(WirelessNode * txNode, int id){
-  std::stringstream msgx;
-  int vectorSize;
-  msgx << txNode->getNodeId() << '#' << 0 << '#' << txNode->getNodeHop() << '#' <<  DREQ << '#' 
-    << id << '#' << txNode->getDreqAtMaster().GetNanoSeconds() << '#' 
-    << txNode->getSyncSendTime().GetNanoSeconds() ;
-
-  vectorSize = txNode->getTimeVectorSize();  
-  for( int m=0; m < vectorSize; m++){
-      msgx << '#' << txNode->getTimeStamp(m).GetNanoSeconds() ;
-    }
-
-  Ptr<Packet> dreq_pkt = Create<Packet>((uint8_t*) msgx.str().c_str(), m_packetSize);
-  return dreq_pkt;
+  return composePacket( txNode, DREQ, id, true );
  }
 
 
  void sendDreqPacket( WirelessNode * txNode, Ptr<Socket> socket, int id){
-    if( id == eventCounterIndex ){
+    if( !sequencer.isReleased( id ) ){
+      sequencer.park( id, ParkedSend( DREQ, txNode, socket, id ) );
+      return;
+    }
+    if( isSilent( txNode ) ){
+      dropSend( id );
+      return;
+    }
     
     Ptr<Socket> socketToNeighbour;
     Ptr<Packet> dreq_pkt = composeDreqPacket( txNode, id );
+    trace.markChanged( txNode->getNodeId() - 1 );
     int numNeighbour = txNode->getNumNeighbour();
     txNode->incrementSentPacketCounter(DREQ);
     txNode->setState(ACTIVE);
+    if( broadcast ){
+      if( phyStamps.isEnabled() ){
+        awaitTxBegin( dreq_pkt, ParkedSend( DREQ, txNode, socket, id ) );
+      }
+      transmit( socketsInNetwork[txNode->getNodeId() - 1]->getSocket(), dreq_pkt );
+      accountTransmission( txNode, DREQ, dreq_pkt, false );
+      globalTime = NanoSeconds(Simulator::Now());
+      sequencer.addPacket( id, numNeighboursOf( txNode->getNodeId() - 1 ) );
+    }
     for( int j = 0 ; j < numNeighbour; j++ ){
             socketToNeighbour = socketsInNetwork[txNode->getNeighbour(j)]->getSocket();
-            socketToNeighbour->Send( dreq_pkt );
+            if( phyStamps.isEnabled() && socketsInNetwork[txNode->getNeighbour(j)]->getRecvId() == txNode->getMasterId() ){
+              // copies share the uid, the upstream neighbour gets a packet of its own so that its
+              // frame is the one that is timestamped
+              Ptr<Packet> upstream_pkt = composeDreqPacket( txNode, id );
+              awaitTxBegin( upstream_pkt, ParkedSend( DREQ, txNode, socket, id ) );
+              transmit( socketToNeighbour, upstream_pkt );
+              accountTransmission( txNode, DREQ, upstream_pkt, true );
+            }else{
+              transmit( socketToNeighbour, dreq_pkt );
+              accountTransmission( txNode, DREQ, dreq_pkt, true );
+            }
             globalTime = NanoSeconds(Simulator::Now());
-            eventCounter[id]++;
+            sequencer.addPacket(id);
     }  
 
     setLocalTimeAtNodes();
-    txNode->addTimeStamp( txNode->getLocalTime(), txNode->getNodeHop(), 2);  
-
-    }else if( id > eventCounterIndex ){
-     Simulator::Schedule ( NanoSeconds( (id - eventCounterIndex) * 100000000 ) , &WirelessNetwork::sendDreqPacket, this, txNode, socket, id );
+    if( !phyStamps.isEnabled() ){
+      txNode->addTimeStamp( txNode->getLocalTime(), txNode->getNodeHop(), 2);  
     }
   } 
 
 
 void sendDrplyPacket(WirelessNode * txNode, Ptr<Socket> socket, int id){
-    if( id == eventCounterIndex ){
+    if( !sequencer.isReleased( id ) ){
+      sequencer.park( id, ParkedSend( DRPLY, txNode, socket, id ) );
+      return;
+    }
+    if( isSilent( txNode ) ){
+      dropSend( id );
+      return;
+    }
     Ptr<Socket> socketToNeighbour;
-    std::stringstream msgx;
   
-    // Sending the DRPLY packet 
-    if( txNode->getNodeHop() > 0 ){
-
-        msgx << txNode->getNodeId() << '#' << 0 << '#' << txNode->getNodeHop() << '#' << DRPLY << '#' 
-        << id << '#' << txNode->getDreqAtMaster().GetNanoSeconds() << '#' 
-        << txNode->getSyncSendTime().GetNanoSeconds();
-        
-        int vectorSize = txNode->getTimeVectorSize();
-        for( int m=0; m < vectorSize; m++){
-            
-              msgx << '#' << txNode->getTimeStamp(m).GetNanoSeconds();
-            
-       }
-
-      }else{
-        msgx << txNode->getNodeId() << '#' << 0 << '#' << txNode->getNodeHop() << '#' << DRPLY << '#' 
-        << id << '#' << txNode->getDreqAtMaster().GetNanoSeconds()  << '#' 
-        << txNode->getSyncSendTime().GetNanoSeconds();
+      // Sending the DRPLY packet, the master has no timestamps to forward
+      Ptr<Packet> drply_pkt = composePacket( txNode, DRPLY, id, txNode->getNodeHop() > 0 );
+      trace.markChanged( txNode->getNodeId() - 1 );
+      if( broadcast ){
+        transmit( socketsInNetwork[txNode->getNodeId() - 1]->getSocket(), drply_pkt );
+        accountTransmission( txNode, DRPLY, drply_pkt, false );
+        sequencer.addPacket( id, numNeighboursOf( txNode->getNodeId() - 1 ) );
       }
-      
-      Ptr<Packet> drply_pkt = Create<Packet>((uint8_t*) msgx.str().c_str(), m_packetSize);
       for(int j = 0 ; j < txNode->getNumNeighbour(); j++){
           socketToNeighbour = socketsInNetwork[txNode->getNeighbour(j)]->getSocket();
-          socketToNeighbour->Send(drply_pkt);    
-          eventCounter[id]++; 
+          transmit( socketToNeighbour, drply_pkt );    
+          accountTransmission( txNode, DRPLY, drply_pkt, true );
+          sequencer.addPacket(id); 
       }
       globalTime = NanoSeconds(Simulator::Now());       
       setLocalTimeAtNodes();
       txNode->incrementSentPacketCounter(DRPLY);
-    }else if( id > eventCounterIndex ){
-      Simulator::Schedule ( NanoSeconds( (id - eventCounterIndex) * 100000000 ), &WirelessNetwork::sendDrplyPacket , this, txNode, socket, id);
-    }
   } 
 
-  void receivePacket (Ptr<Socket> socket)
+  // DRPLY to a single child, carrying the receive time of that child's DREQ
+  void sendSlottedDrplyPacket( WirelessNode * txNode, uint32_t requesterId, Time requestTime ){
+    if( isSilent( txNode ) ){
+      return;
+    }
+    if( txNode->isNodeMaster() ){
+      txNode->setDreqAtMaster( requestTime );
+    }else{
+      txNode->addTimeStamp( requestTime, txNode->getNodeHop(), 1 );
+    }
+    replyTo = requesterId;
+    Ptr<Packet> drply_pkt = composePacket( txNode, DRPLY, eventId, txNode->getNodeHop() > 0 );
+    replyTo = 0;
+    eventId++;
+    trace.markChanged( txNode->getNodeId() - 1 );
+    if( broadcast ){
+      transmit( socketsInNetwork[txNode->getNodeId() - 1]->getSocket(), drply_pkt );
+      accountTransmission( txNode, DRPLY, drply_pkt, false );
+    }
+    for( int j = 0 ; !broadcast && j < txNode->getNumNeighbour(); j++ ){
+      SocketPoint * point = socketsInNetwork[txNode->getNeighbour(j)];
+      if( point->getRecvId() == requesterId ){
+        transmit( point->getSocket(), drply_pkt );
+        accountTransmission( txNode, DRPLY, drply_pkt, true );
+      }
+    }
+    globalTime = NanoSeconds(Simulator::Now());
+    setLocalTimeAtNodes();
+    txNode->incrementSentPacketCounter(DRPLY);
+  }
+
+  // A failed Send, e.g. a DREQ over the 65507 byte UDP limit deep in a chain, would otherwise
+  // only show as an exchange that never completes
+  void transmit( Ptr<Socket> socket, Ptr<Packet> pkt ){
+    if( socket->Send( pkt ) < 0 ){
+      sendFailures++;
+    }
+  }
+
+  bool hasFailed( WirelessNode * node ){
+    return !alive.empty() && !alive[ node->getNodeId() - 1 ];
+  }
+
+  // a silent node sends nothing for its released event id, the events after it must not wait for it
+  void dropSend( int id ){
+    if( sequencer.skip( id ) ){
+      releaseParkedSends();
+    }
+  }
+
+  // failed, or not part of the sync tree: takes no part in the exchanges
+  bool isSilent( WirelessNode * node ){
+    return hasFailed( node ) || ( !inSyncTree.empty() && !inSyncTree[ node->getNodeId() - 1 ] );
+  }
+
+  // Runs the sends that were parked until the current event was released
+  void releaseParkedSends(){
+    sequencer.takeReleased( releasedSends );
+    for( size_t j = 0; j < releasedSends.size(); j++ ){
+      ParkedSend &send = releasedSends[j];
+      switch( send.msgType ){
+        case SYNC : Simulator::ScheduleNow( &WirelessNetwork::sendSyncFollowPacket, this, send.txNode, send.socket, send.id );
+                    break;
+        case DREQ : Simulator::ScheduleNow( &WirelessNetwork::sendDreqPacket, this, send.txNode, send.socket, send.id );
+                    break;
+        case DRPLY : Simulator::ScheduleNow( &WirelessNetwork::sendDrplyPacket, this, send.txNode, send.socket, send.id );
+                    break;
+      }
+    }
+  }
+
+  // i is the index of the receiving socket in socketsInNetwork, bound into the
+  // socket's receive callback when it is created (see receiveAtSocketPoint)
+  void receivePacket (uint32_t i, Ptr<Socket> socket)
+  {
+    if( !profiling ){
+      processPacket( i, socket );
+      return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    processPacket( i, socket );
+    receiveTime += std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+  }
+
+  void processPacket (uint32_t i, Ptr<Socket> socket)
   { 
     globalTime = NanoSeconds(Simulator::Now()); // record time when pkt is received at socket
     nodes[masterIndex]->setLocalTime(globalTime);
     Time syncSendTime, dreqAtMaster;
     Ipv4Address senderIp, receiverIp, recvIp;
     uint16_t senderHop, myHop;
-    uint16_t i = 0, nodeId, nodeIndex;
-    int count = 0, MSG_TYPE, receiverId, myId, senderId, event_id, numNeighbour, k = 0;
-    char delim = '#';
+    uint32_t nodeId, nodeIndex;
+    int MSG_TYPE, receiverId, myId, senderId, event_id, numNeighbour, k = 0;
     
     WirelessNode *recvNode;
     Ptr<Socket> socketToNeighbour;
     Ptr<Packet> pkt_received = socket->Recv();
-    uint8_t *buffer = new uint8_t[pkt_received->GetSize()]; 
-    pkt_received->CopyData (buffer, pkt_received->GetSize());
+    pkt_received->RemoveHeader( rxHeader );
+    Time rxBegin;
 
-    while( !(socketsInNetwork[i]->getSocket() == socket) ){
-      i++;
-    }
-    
     // Determine the node of receiving socket
     nodeId = socketsInNetwork[i]->getTxId();
     nodeIndex = nodeId - 1 ;
     
     // Get Pointer to the node
     recvNode = this->getNode( nodeIndex );
+    trace.markChanged( nodeIndex );
     setLocalTimeAtNodes();
     myHop = recvNode->getNodeHop();
     myId = recvNode->getNodeId();
     numNeighbour = recvNode->getNumNeighbour();
+    // receive timestamp, the start of the frame at the PHY if it was recorded
+    Time rxLocalTime = recvNode->getLocalTime();
+    if( phyStamps.isEnabled() && phyStamps.lookup( nodeIndex, pkt_received->GetUid(), rxBegin ) ){
+      rxLocalTime = recvNode->localTimeAt( rxBegin );
+    }
+    // the attempt received is the last one the sender stamped
+    std::map< uint64_t, PendingTxStamp >::iterator pending = awaitingTxBegin.find( pkt_received->GetUid() );
+    if( pending != awaitingTxBegin.end() ){
+      finishTxStamp( pending );
+    }
 
-    std::vector<Time> recvTimeStamps;
-    std::string msg_received(reinterpret_cast<char*>(buffer));
-    std::stringstream msg_stream( msg_received );
-    std::string item;
-    
     // Read contents of the packet
-    senderId = buffer[0] - '0';
-    receiverId = buffer[2] - '0';
-    senderHop = buffer[4] - '0';
-    MSG_TYPE = buffer[6] - '0';
+    senderId = rxHeader.getSenderId();
+    receiverId = rxHeader.getReceiverId();
+    senderHop = rxHeader.getHop();
+    MSG_TYPE = rxHeader.getMsgType();
+    event_id = rxHeader.getEventId();
+    dreqAtMaster = rxHeader.getDreqAtMaster();
+    syncSendTime = rxHeader.getSyncSendTime();
+
+    // a failed node handles nothing, its receptions only complete their events in the sequencer
+    if( hasFailed( recvNode ) ){
+      if( MSG_TYPE != ANNOUNCE && MSG_TYPE != HELLO && sequencer.removePacket( event_id ) ){
+        releaseParkedSends();
+      }
+      return;
+    }
+
+    if( MSG_TYPE == HELLO ){
+      processHello( nodeIndex, senderId );
+      return;
+    }
+
+    // a broadcast reaches every node in radio range, only the neighbours in the topology take part
+    if( broadcast && !isNeighbour( nodeIndex, senderId ) ){
+      recvNode->incrementOverheardPacketCounter(MSG_TYPE);
+      return;
+    }
+
+    if( MSG_TYPE == ANNOUNCE ){
+      processAnnounce( nodeIndex, senderId );
+      return;
+    }
+    // a node outside the elected tree takes no part, but its receptions were counted for the event
+    if( !inSyncTree.empty() && !inSyncTree[nodeIndex] ){
+      recvNode->incrementOverheardPacketCounter(MSG_TYPE);
+      if( sequencer.removePacket( event_id ) ){
+        releaseParkedSends();
+      }
+      return;
+    }
+
+    // Only the tree edges take part in an exchange: a node keeps the DREQ and DRPLY of its parent
+    // and the DREQs of its children. On a grid every lower-hop neighbour would otherwise start a
+    // DREQ of its own and answer the node, and the DRPLYs of different relays would be mixed.
+    // Slotted mode addresses the DREQs and DRPLYs to the node that has to answer them.
+    if( MSG_TYPE == DREQ || MSG_TYPE == DRPLY ){
+      bool fromParent = senderHop < myHop && (uint32_t) senderId == recvNode->getMasterId();
+      bool fromChild = senderHop > myHop && nodes[senderId - 1]->getMasterId() == (uint32_t) myId;
+      bool kept = slotted ? ( MSG_TYPE == DREQ && fromParent ) || receiverId == myId
+                          : fromParent || ( MSG_TYPE == DREQ && fromChild );
+      if( !kept ){
+        recvNode->incrementOverheardPacketCounter(MSG_TYPE);
+        if( sequencer.removePacket( event_id ) ){
+          releaseParkedSends();
+        }
+        return;
+      }
+    }
     
     std::string msgType;
     switch( MSG_TYPE ){
@@ -739,27 +3674,15 @@ void sendDrplyPacket(WirelessNode * txNode, Ptr<Socket> socket, int id){
       recvNode->setState(ACTIVE);
     }
 
-    senderIp = socketsInNetwork[i]->getRecvIp();
-    receiverIp = socketsInNetwork[i]->getTxIp();
-
-    while (getline(msg_stream, item, delim)){
-        if( count >= 4 ){
-        if( count >= 7 ){
-          recvTimeStamps.push_back( NanoSeconds( stoll( item, nullptr, 10 ) ) );
-        }else if( count == 5 ){
-          dreqAtMaster = NanoSeconds( stoll( item, nullptr, 10 ) );
-        }else if( count == 6 ){
-          syncSendTime = NanoSeconds( stoll( item, nullptr, 10 ) );
-        }else{
-          event_id = stoi( item, nullptr, 10 );
-        }
-      }
-      count++;
+    if( broadcast ){
+      senderIp = nodes[senderId - 1]->getIpv4Address();
+    }else{
+      senderIp = socketsInNetwork[i]->getRecvIp();
     }
+    receiverIp = socketsInNetwork[i]->getTxIp();
 
-    eventCounter[event_id]--;
-    if( eventCounter[eventCounterIndex] == 0 ){
-      eventCounterIndex++;
+    if( sequencer.removePacket( event_id ) ){
+      releaseParkedSends();
     }
 
     
@@ -768,23 +3691,30 @@ void sendDrplyPacket(WirelessNode * txNode, Ptr<Socket> socket, int id){
         if( senderHop < myHop ){
           // store the timestamps and wait for sometime and then send a DREQ pkt 
           recvNode->setSyncStartTime(globalTime);
-          recvNode->copyTimeVector( dreqAtMaster, syncSendTime, recvTimeStamps );
-          recvNode->addTimeStamp( recvNode->getLocalTime(), myHop, 0 );
-          k = eventId - eventCounterIndex;
+          recvNode->copyTimeVector( rxHeader );
+          recvNode->addTimeStamp( rxLocalTime, myHop, 0 );
+          k = eventId - sequencer.getCurrentId();
           k = k > 0 ? k : 1;
-          Simulator::Schedule ( NanoSeconds( k * 1000000 ), &WirelessNetwork::sendDreqPacket, this, recvNode, socketToNeighbour, eventId );
+          Simulator::Schedule ( slotted ? reserveSlot( recvNode ) : NanoSeconds( (int64_t) k * 1000000 ), &WirelessNetwork::sendDreqPacket, this, recvNode, socketToNeighbour, eventId );
           eventId++;
           printClockValuesOfNodes( senderIp, receiverIp, senderHop, msgType, dreqAtMaster, syncSendTime, event_id); 
+        }else if( senderHop > myHop && slotted ){
+            // answered in order once this node has the timestamps of the round
+            pendingReplies[nodeIndex].push_back( PendingReply( senderId, rxLocalTime ) );
+            if( recvNode->getState() == SYNCED ){
+              scheduleReplies( recvNode );
+            }
+            printClockValuesOfNodes( senderIp, receiverIp, senderHop, msgType, dreqAtMaster, syncSendTime, event_id); 
         }else if( senderHop > myHop ){
             // record the timestamp of Dreq pkt and send a DRPLY containing that timestamp 
             if( myHop == 0 ){
-              recvNode->setDreqAtMaster(recvNode->getLocalTime());
+              recvNode->setDreqAtMaster( rxLocalTime );
             }else{
-              recvNode->addTimeStamp( recvNode->getLocalTime(), myHop, 1 );
+              recvNode->addTimeStamp( rxLocalTime, myHop, 1 );
             }
-            k = eventId - eventCounterIndex;
+            k = eventId - sequencer.getCurrentId();
             k = k > 0 ? k : 1;
-            Simulator::Schedule( NanoSeconds( k * 1000000 ), &WirelessNetwork::sendDrplyPacket, this, recvNode, socket, eventId );
+            Simulator::Schedule( NanoSeconds( (int64_t) k * 1000000 ), &WirelessNetwork::sendDrplyPacket, this, recvNode, socket, eventId );
             eventId++;
             printClockValuesOfNodes( senderIp, receiverIp, senderHop, msgType, dreqAtMaster, syncSendTime, event_id); 
         }
@@ -794,18 +3724,37 @@ void sendDrplyPacket(WirelessNode * txNode, Ptr<Socket> socket, int id){
         if( senderHop < myHop && recvNode->getState() == ACTIVE ){
           // rply from master, store the timstamp
           if( senderHop > 0 ){
-            recvNode->copyTimeVector( dreqAtMaster, syncSendTime, recvTimeStamps );
+            recvNode->copyTimeVector( rxHeader );
           }else{
             recvNode->setDreqAtMaster(dreqAtMaster);
             recvNode->setSyncSendTime(syncSendTime);
           }
           recvNode->setSyncEndTime(globalTime);
-          recvNode->setSynchronizationTime();
           recvNode->incrementReceivedPacketCounter(MSG_TYPE);
           recvNode->calculateOffset();
-          recvNode->setOldOffsetError(this->getNode(masterIndex)->getLocalTime());
-          recvNode->setNewOffsetError(this->getNode(masterIndex)->getLocalTime());
+          Time masterTime = this->getNode(masterIndex)->getLocalTime();
+          double errorBefore = std::abs( (double)( recvNode->getLocalTime().GetNanoSeconds() - masterTime.GetNanoSeconds() ) );
+          recvNode->setOldOffsetError(masterTime);
+          recvNode->addAccuracySample(masterTime);
+          recvNode->setNewOffsetError(masterTime);
+          stats.addCorrection( myHop, recvNode->getSynchronizationTime(), errorBefore,
+            std::abs( (double)( recvNode->getLocalTime().GetNanoSeconds() - masterTime.GetNanoSeconds() ) ) );
+          if( !lastSync.empty() ){
+            noteSync( nodeIndex, errorBefore );
+          }
+          if( capture != 0 ){
+            capture->noteError( errorBefore );
+          }
           recvNode->setState(SYNCED);
+          if( slotted ){
+            scheduleReplies( recvNode );
+          }
+          if( correctionsInRun( nodeIndex ) == 1 ){
+            syncedNodes++;
+            if( syncedNodes == nodes.size() - 1 ){
+              allSyncedTime = globalTime;
+            }
+          }
           printClockValuesOfNodes( senderIp, receiverIp, senderHop, msgType, dreqAtMaster, syncSendTime, event_id); 
         }else{
           recvNode->incrementOverheardPacketCounter(MSG_TYPE);
@@ -815,65 +3764,842 @@ void sendDrplyPacket(WirelessNode * txNode, Ptr<Socket> socket, int id){
         // store SYNC receive time and wait for follow up
         recvNode->setSyncStartTime(globalTime);
         recvNode->incrementReceivedPacketCounter(MSG_TYPE);
-        recvNode->addTimeStamp( recvNode->getLocalTime(), myHop, 0 );
+        recvNode->addTimeStamp( rxLocalTime, myHop, 0 );
+        if( oneStep ){
+          // the SYNC carries its own send time, nothing to wait for
+          recvNode->setSyncSendTime(syncSendTime);
+          Simulator::Schedule ( slotted ? reserveSlot( recvNode ) : NanoSeconds( (int64_t) k * 10000000 ), &WirelessNetwork::sendDreqPacket, this, recvNode, socket , eventId);
+          eventId++;
+        }
+        printClockValuesOfNodes( senderIp, receiverIp, senderHop, msgType, dreqAtMaster, syncSendTime, event_id); 
+
+    }else if( MSG_TYPE == FOLLOW ){
+
+        // store SYNC Send time contained in pkt and send DREQ 
+        recvNode->incrementReceivedPacketCounter(MSG_TYPE);
+        recvNode->setSyncSendTime(syncSendTime);
+        Simulator::Schedule ( slotted ? reserveSlot( recvNode ) : NanoSeconds( (int64_t) k * 10000000 ), &WirelessNetwork::sendDreqPacket, this, recvNode, socket , eventId);
+        eventId++; 
         printClockValuesOfNodes( senderIp, receiverIp, senderHop, msgType, dreqAtMaster, syncSendTime, event_id); 
+    }
+  
+ }
+
+private:
+  int eventId;
+  EventSequencer sequencer;
+  std::vector< ParkedSend > releasedSends; 
+  const uint32_t m_users;
+  const std::vector<int> m_neighbourNode;
+  const uint32_t m_packetSize;
+  const Time m_interPacketInterval;
+  uint32_t masterIndex;
+  bool election; // master and tree elected at runtime, see SetElection
+  Time electionSlot;
+  std::vector< BmcDataset > bmc; // per node, best clock known
+  std::vector< uint8_t > announcePending; // per node, an ANNOUNCE is scheduled
+  std::vector< bool > inSyncTree; // per node, elected the same grandmaster as the master
+  std::vector< uint8_t > priority; // per node, priority1 of its own clock
+  uint32_t announcesSent;
+  uint32_t treeDepth;
+  Time electionTime; // from the start of an election to the new tree
+  std::vector< bool > alive; // per node, false once it failed
+  uint32_t syncTimeout; // sync intervals without an exchange before a node declares its master lost, 0 for never
+  std::vector< Time > lastSync; // per node, last completed exchange
+  std::vector< bool > needsResync; // per node, not synchronized to the backup master yet
+  uint32_t resyncPending;
+  bool failoverStarted;
+  bool failoverApplied;
+  uint32_t treeEpoch; // election epoch the current tree was built in
+  Time stallTimeout; // interval of checkStall, 0 to wait for every packet
+  int stallEventId; // sequencer event seen by the previous checkStall
+  Time failureTime;
+  Time detectionTime;
+  Time resyncTime;
+  double outagePeakOffset; // ns, largest offset from the reference between failure and resync
+  bool mobile; // neighbours found by HELLOs and the tree repaired locally, see SetMobility
+  Time helloInterval;
+  uint32_t helloLoss; // HELLO intervals without one before a neighbour is dropped
+  Time repairHold; // an orphan waits this long for its subtree to detach before it attaches
+  std::vector< std::vector< NeighbourEntry > > neighbourTable; // per node, the neighbours heard recently
+  std::vector< Time > orphanSince; // per node, when it detached, 0 while attached
+  std::vector< Time > movedAt; // per node, when its place in the tree changed, 0 once resynchronized
+  uint32_t linkChanges;
+  uint32_t reparents;
+  uint32_t repairMessages; // triggered HELLOs of the tree repair
+  double movedResyncSum; // seconds from a move to the next completed exchange, summed
+  uint32_t movedResyncSamples;
+  PacketCapture *capture; // 0 without a filtered capture
+  uint32_t sendFailures; // packets the sockets refused
+  uint64_t controlSent; // ANNOUNCE and HELLO messages, per node only with the node statistics
+  uint64_t controlReceived;
+  uint64_t bytesSent; // UDP payload bytes of all transmissions
+  uint32_t syncedNodes; // nodes synchronized at least once
+  std::vector< int > restoredCorrections; // per node, corrections taken over from a snapshot
+  Time protocolStartTime;
+  Time allSyncedTime; // when the last node synchronized for the first time
+  uint32_t syncRound; // rounds started so far
+  uint32_t syncRounds;
+  Time syncInterval;
+  bool lazyClocks; // evaluate node clocks on demand instead of sweeping all nodes on every event
+  bool transparentClock; // relays accumulate a correction instead of forwarding all timestamps
+  bool slotted; // concurrent exchanges in TDMA slots instead of the global event order
+  std::vector< uint32_t > slotColor; // slot of every node in the frame
+  uint32_t numSlots; // slots per frame
+  Time slotLength;
+  std::vector< Time > nextFreeSlot; // per node, nothing may be scheduled before it
+  std::vector< std::vector< PendingReply > > pendingReplies; // per node, DREQs of children not answered yet
+  uint32_t replyTo; // receiver id of the DRPLY being composed
+  bool oneStep; // SYNC carries the send time, no FOLLOW
+  PhyTimestamps phyStamps; // receive times from the PHY, empty unless enabled
+  std::map< uint64_t, PendingTxStamp > awaitingTxBegin; // frames, by packet uid, whose PHY send time is needed
+  Time txStampTimeout; // after which a frame in awaitingTxBegin is given up on
+  bool broadcast; // one socket per node, every message sent once to all neighbours
+  std::vector< uint32_t > neighbourStart; // offset of every node's neighbour list in m_neighbourNode
+  bool rightSizedFrames; // no padding to m_packetSize
+  double dataRate; // Mbps of the phy mode, for airtime accounting
+  bool ofdm;
+  Time totalAirtime;
+  Time lastTransmissionEnd;
+  bool profiling;
+  double receiveTime; // seconds spent in receivePacket while profiling
+  Time globalTime;
+  int* sock_index;
+  std::vector< SocketPoint * > socketsInNetwork;
+  std::vector< WirelessNode * > nodes;
+  ClockTrace trace;
+  ConvergenceStats stats;
+  Time statsInterval;
+  std::ofstream statsFile;
+  uint64_t correctionsAtCheckpoint;
+  PtpHeader txHeader; // reused for every outgoing message
+  PtpHeader rxHeader; // reused for every incoming message
+
+public:
+  static const uint8_t DEFAULT_PRIORITY = 128; // priority1 of a node that is no grandmaster candidate
+  static const uint16_t DETACHED = 0xFFFF; // hop in the HELLO of a node without a path to the master
+};
+
+const uint8_t WirelessNetwork::DEFAULT_PRIORITY;
+const uint16_t WirelessNetwork::DETACHED;
+
+
+// Receive callback of every socket, bound to the network and the index of the socket's
+// SocketPoint so the receiving node is found without scanning all sockets
+static void receiveAtSocketPoint( WirelessNetwork *network, uint32_t socketIndex, Ptr<Socket> socket ){
+  network->receivePacket( socketIndex, socket );
+}
+
+// PHY trace sinks, bound to the network and the index of the node whose device fired
+static void phyTxBeginAt( WirelessNetwork *network, uint32_t nodeIndex, Ptr<const Packet> packet ){
+  network->phyTxBegin( nodeIndex, packet );
+}
+
+static void phyRxBeginAt( WirelessNetwork *network, uint32_t nodeIndex, Ptr<const Packet> packet ){
+  network->phyRxBegin( nodeIndex, packet );
+}
+
+//-------------------------------------------------X--End of WirelessNetwork Class--X------------------------------------------
+
+
+
+//-------------------------------------------------X--Start of Topology Class--X------------------------------------------
+
+// Undirected graph of the network, generated or loaded from a file. Nodes are indexed from 0
+// (node id = index + 1). computeSyncTree() derives every node's hop and master (parent) by a
+// breadth first search from the grandmaster.
+class Topology{
+public:
+  Topology()
+  : spacing(5.0)
+  {
+  }
+
+  // 1 - 2 - 3 - ... - n
+  void makeChain( uint32_t n ){
+    reset( n );
+    for( uint32_t i = 0; i < n; i++ ){
+      positions[i] = Vector( 5.0, spacing * (i+1), 0.0 );
+      if( i > 0 ){
+        addEdge( i-1, i );
+      }
+    }
+  }
+
+  // complete tree where node i is the parent of nodes fanout*i+1 ... fanout*i+fanout
+  void makeTree( uint32_t n, uint32_t fanout ){
+    reset( n );
+    for( uint32_t i = 1; i < n; i++ ){
+      addEdge( (i-1) / fanout, i );
+    }
+    for( uint32_t i = 0; i < n; i++ ){
+      positions[i] = Vector( spacing * i, spacing * depthInTree( i, fanout ), 0.0 );
+    }
+  }
+
+  // square-ish grid filled row by row, each node linked to its right and lower neighbour
+  void makeGrid( uint32_t n ){
+    reset( n );
+    uint32_t width = std::ceil( std::sqrt( (double) n ) );
+    for( uint32_t i = 0; i < n; i++ ){
+      positions[i] = Vector( spacing * (i % width), spacing * (i / width), 0.0 );
+      if( i % width != 0 ){
+        addEdge( i-1, i );
+      }
+      if( i >= width ){
+        addEdge( i-width, i );
+      }
+    }
+  }
+
+  // nodes uniformly placed in a square with the density of one node per spacing^2, linked when
+  // closer than range * spacing. Components that end up isolated are joined to their nearest node.
+  void makeRandomGeometric( uint32_t n, double range ){
+    reset( n );
+    double side = spacing * std::sqrt( (double) n );
+    double linkDistance = range * spacing;
+    Ptr<UniformRandomVariable> uniform = CreateObject<UniformRandomVariable> ();
+    for( uint32_t i = 0; i < n; i++ ){
+      positions[i] = Vector( uniform->GetValue( 0, side ), uniform->GetValue( 0, side ), 0.0 );
+    }
+
+    // bucket the nodes in cells of linkDistance so only neighbouring cells are compared
+    uint32_t cells = std::max( 1.0, std::ceil( side / linkDistance ) );
+    std::vector< std::vector< uint32_t > > grid( cells * cells );
+    for( uint32_t i = 0; i < n; i++ ){
+      grid[ cellOf( positions[i], linkDistance, cells ) ].push_back( i );
+    }
+    for( uint32_t i = 0; i < n; i++ ){
+      int cx = std::min( (uint32_t)( positions[i].x / linkDistance ), cells - 1 );
+      int cy = std::min( (uint32_t)( positions[i].y / linkDistance ), cells - 1 );
+      for( int dx = -1; dx <= 1; dx++ ){
+        for( int dy = -1; dy <= 1; dy++ ){
+          if( cx + dx < 0 || cy + dy < 0 || cx + dx >= (int) cells || cy + dy >= (int) cells ){
+            continue;
+          }
+          std::vector< uint32_t > &cell = grid[ (cy + dy) * cells + cx + dx ];
+          for( size_t m = 0; m < cell.size(); m++ ){
+            if( cell[m] > i && CalculateDistance( positions[i], positions[ cell[m] ] ) <= linkDistance ){
+              addEdge( i, cell[m] );
+            }
+          }
+        }
+      }
+    }
+    connectComponents();
+  }
+
+  // Reads an edge list ("u v" per line) or adjacency lists ("u: v w x" per line) with 1-based
+  // node ids. Lines starting with '#' are comments.
+  bool loadFromFile( std::string fileName ){
+    std::ifstream in( fileName.c_str() );
+    if( !in.is_open() ){
+      std::cerr << "cannot open topology file " << fileName << std::endl;
+      return false;
+    }
+    std::vector< std::pair< uint32_t, uint32_t > > edges;
+    uint32_t n = 0, u, v;
+    std::string line;
+    while( std::getline( in, line ) ){
+      if( line.empty() || line[0] == '#' ){
+        continue;
+      }
+      size_t colon = line.find( ':' );
+      if( colon != std::string::npos ){
+        line[colon] = ' ';
+      }
+      std::stringstream lineStream( line );
+      if( !( lineStream >> u ) || u == 0 ){
+        continue;
+      }
+      n = std::max( n, u );
+      while( lineStream >> v ){
+        if( v == 0 ){
+          std::cerr << "node ids in " << fileName << " start at 1" << std::endl;
+          return false;
+        }
+        n = std::max( n, v );
+        edges.push_back( std::make_pair( u-1, v-1 ) );
+      }
+    }
+    reset( n );
+    for( size_t e = 0; e < edges.size(); e++ ){
+      if( edges[e].first != edges[e].second && !hasEdge( edges[e].first, edges[e].second ) ){
+        addEdge( edges[e].first, edges[e].second );
+      }
+    }
+    for( uint32_t i = 0; i < n; i++ ){
+      positions[i] = Vector( 5.0, spacing * (i+1), 0.0 );
+    }
+    return true;
+  }
+
+  // Breadth first search from the grandmaster: hop = distance in links, master = parent's node id.
+  // Returns the number of nodes that cannot reach the grandmaster.
+  uint32_t computeSyncTree( uint32_t masterIndex ){
+    uint32_t n = adjacency.size(), unreachable = n;
+    hop.assign( n, UNREACHABLE );
+    master.assign( n, 0 );
+    std::vector< uint32_t > queue;
+    queue.reserve( n );
+    queue.push_back( masterIndex );
+    hop[masterIndex] = 0;
+    master[masterIndex] = masterIndex + 1;
+    for( size_t head = 0; head < queue.size(); head++ ){
+      uint32_t u = queue[head];
+      unreachable--;
+      for( size_t m = 0; m < adjacency[u].size(); m++ ){
+        uint32_t v = adjacency[u][m];
+        if( hop[v] == UNREACHABLE ){
+          hop[v] = hop[u] + 1;
+          master[v] = u + 1;
+          queue.push_back( v );
+        }
+      }
+    }
+    return unreachable;
+  }
+
+  // Greedy distance-2 coloring in index order: nodes that are neighbours or share a neighbour get
+  // different colors. Returns the number of colors, at most maxDegree^2 + 1.
+  uint32_t colorTwoHop( std::vector< uint32_t > &colors ){
+    uint32_t n = adjacency.size(), numColors = 0;
+    colors.assign( n, 0 );
+    std::vector< uint32_t > takenAt; // takenAt[c] == v + 1 if color c is used around node v
+    for( uint32_t v = 0; v < n; v++ ){
+      for( size_t a = 0; a < adjacency[v].size(); a++ ){
+        uint32_t u = adjacency[v][a];
+        if( u < v ){
+          takeColor( takenAt, colors[u], v );
+        }
+        for( size_t b = 0; b < adjacency[u].size(); b++ ){
+          if( adjacency[u][b] < v ){
+            takeColor( takenAt, colors[ adjacency[u][b] ], v );
+          }
+        }
+      }
+      uint32_t c = 0;
+      while( c < takenAt.size() && takenAt[c] == v + 1 ){
+        c++;
+      }
+      colors[v] = c;
+      numColors = std::max( numColors, c + 1 );
+    }
+    return numColors;
+  }
+
+  uint32_t getNumNodes(){
+    return adjacency.size();
+  }
+
+  uint32_t getNumNeighbour( uint32_t i ){
+    return adjacency[i].size();
+  }
+
+  // index of the j-th neighbour of node i
+  uint32_t getNeighbour( uint32_t i, uint32_t j ){
+    return adjacency[i][j];
+  }
+
+  // position of node i in the neighbour list of node j
+  uint32_t getNeighbourPosition( uint32_t j, uint32_t i ){
+    return std::find( adjacency[j].begin(), adjacency[j].end(), i ) - adjacency[j].begin();
+  }
+
+  uint16_t getHop( uint32_t i ){
+    return hop[i];
+  }
+
+  uint32_t getMaster( uint32_t i ){
+    return master[i];
+  }
+
+  Vector getPosition( uint32_t i ){
+    return positions[i];
+  }
+
+  // links and positions, for the snapshot files
+  void writeTo( std::ostream &os ){
+    writeRaw( os, (uint32_t) adjacency.size() );
+    for( uint32_t i = 0; i < adjacency.size(); i++ ){
+      writeRaw( os, positions[i].x );
+      writeRaw( os, positions[i].y );
+      writeRaw( os, positions[i].z );
+      writeRaw( os, (uint32_t) adjacency[i].size() );
+      for( size_t m = 0; m < adjacency[i].size(); m++ ){
+        writeRaw( os, adjacency[i][m] );
+      }
+    }
+  }
+
+  bool readFrom( std::istream &in ){
+    uint32_t n = 0, degree = 0;
+    if( !readRaw( in, n ) ){
+      return false;
+    }
+    reset( n );
+    for( uint32_t i = 0; i < n; i++ ){
+      if( !readRaw( in, positions[i].x ) || !readRaw( in, positions[i].y ) || !readRaw( in, positions[i].z )
+          || !readRaw( in, degree ) || degree > n ){
+        return false;
+      }
+      adjacency[i].resize( degree );
+      for( uint32_t m = 0; m < degree; m++ ){
+        if( !readRaw( in, adjacency[i][m] ) || adjacency[i][m] >= n ){
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  static const uint16_t UNREACHABLE = 0xffff;
+
+private:
+  void reset( uint32_t n ){
+    adjacency.assign( n, std::vector< uint32_t >() );
+    positions.assign( n, Vector() );
+    hop.clear();
+    master.clear();
+  }
+
+  void addEdge( uint32_t u, uint32_t v ){
+    adjacency[u].push_back( v );
+    adjacency[v].push_back( u );
+  }
+
+  bool hasEdge( uint32_t u, uint32_t v ){
+    return std::find( adjacency[u].begin(), adjacency[u].end(), v ) != adjacency[u].end();
+  }
+
+  static void takeColor( std::vector< uint32_t > &takenAt, uint32_t color, uint32_t v ){
+    if( color >= takenAt.size() ){
+      takenAt.resize( color + 1, 0 );
+    }
+    takenAt[color] = v + 1;
+  }
+
+  static uint32_t depthInTree( uint32_t i, uint32_t fanout ){
+    uint32_t depth = 0;
+    while( i > 0 ){
+      i = (i-1) / fanout;
+      depth++;
+    }
+    return depth;
+  }
+
+  static uint32_t cellOf( Vector p, double cellSize, uint32_t cells ){
+    uint32_t cx = std::min( (uint32_t)( p.x / cellSize ), cells - 1 );
+    uint32_t cy = std::min( (uint32_t)( p.y / cellSize ), cells - 1 );
+    return cy * cells + cx;
+  }
+
+  // joins every component not containing node 0 to the nearest node already connected to it
+  void connectComponents(){
+    uint32_t n = adjacency.size();
+    std::vector< uint8_t > reached( n, 0 );
+    std::vector< uint32_t > queue;
+    for( uint32_t start = 0; start < n; start++ ){
+      if( reached[start] ){
+        continue;
+      }
+      if( start > 0 ){
+        uint32_t nearest = 0;
+        double best = -1;
+        for( uint32_t i = 0; i < n; i++ ){
+          double d = CalculateDistance( positions[start], positions[i] );
+          if( reached[i] && ( best < 0 || d < best ) ){
+            best = d;
+            nearest = i;
+          }
+        }
+        addEdge( start, nearest );
+      }
+      queue.clear();
+      queue.push_back( start );
+      reached[start] = 1;
+      for( size_t head = 0; head < queue.size(); head++ ){
+        uint32_t u = queue[head];
+        for( size_t m = 0; m < adjacency[u].size(); m++ ){
+          if( !reached[ adjacency[u][m] ] ){
+            reached[ adjacency[u][m] ] = 1;
+            queue.push_back( adjacency[u][m] );
+          }
+        }
+      }
+    }
+  }
+
+  double spacing; // distance between neighbouring nodes in metres
+  std::vector< std::vector< uint32_t > > adjacency;
+  std::vector< Vector > positions;
+  std::vector< uint16_t > hop;
+  std::vector< uint32_t > master;
+};
+
+const uint16_t Topology::UNREACHABLE;
+
+//-------------------------------------------------X--End of Topology Class--X------------------------------------------
+
+
+//-------------------------------------------------X--Start of ScenarioSnapshot--X------------------------------------------
 
-    }else if( MSG_TYPE == FOLLOW ){
+// Converged state of a run: topology, master and every node. Saved at the end of a warm-up run
+// and restored by later runs, which then measure the steady state from their first round.
+struct ScenarioSnapshot{
+  ScenarioSnapshot()
+  : masterIndex(0)
+  {
+  }
 
-        // store SYNC Send time contained in pkt and send DREQ 
-        recvNode->incrementReceivedPacketCounter(MSG_TYPE);
-        recvNode->setSyncSendTime(syncSendTime);
-        Simulator::Schedule ( NanoSeconds( k * 10000000 ), &WirelessNetwork::sendDreqPacket, this, recvNode, socket , eventId);
-        eventId++; 
-        printClockValuesOfNodes( senderIp, receiverIp, senderHop, msgType, dreqAtMaster, syncSendTime, event_id); 
+  bool save( std::string fileName ){
+    std::ofstream os( fileName.c_str(), std::ios::binary );
+    if( !os.is_open() ){
+      std::cerr << "cannot open snapshot file " << fileName << std::endl;
+      return false;
     }
-  
- }
+    os.write( MAGIC, sizeof( MAGIC ) );
+    writeRaw( os, (uint32_t) NUM_MSG_TYPES );
+    topology.writeTo( os );
+    writeRaw( os, masterIndex );
+    for( uint32_t j = 0; j < nodes.size(); j++ ){
+      nodes[j].write( os );
+    }
+    return !os.fail();
+  }
+
+  bool load( std::string fileName ){
+    std::ifstream in( fileName.c_str(), std::ios::binary );
+    if( !in.is_open() ){
+      std::cerr << "cannot open snapshot file " << fileName << std::endl;
+      return false;
+    }
+    char magic[ sizeof( MAGIC ) ];
+    uint32_t numTypes = 0;
+    bool ok = in.read( magic, sizeof( magic ) ) && std::equal( magic, magic + sizeof( magic ), MAGIC )
+      && readRaw( in, numTypes ) && numTypes == NUM_MSG_TYPES && topology.readFrom( in )
+      && readRaw( in, masterIndex ) && masterIndex < topology.getNumNodes();
+    nodes.assign( ok ? topology.getNumNodes() : 0, NodeSnapshot() );
+    for( uint32_t j = 0; ok && j < nodes.size(); j++ ){
+      ok = nodes[j].read( in );
+    }
+    if( !ok ){
+      std::cerr << fileName << " is not a snapshot of this version" << std::endl;
+    }
+    return ok;
+  }
+
+  Topology topology;
+  uint32_t masterIndex;
+  std::vector< NodeSnapshot > nodes;
 
 private:
-  int eventId;
-  int eventCounterIndex;
-  std::vector< int > eventCounter; 
-  const uint32_t m_users;
-  const std::vector<int> m_neighbourNode;
-  const uint32_t m_packetSize;
-  const Time m_interPacketInterval;
-  uint16_t masterIndex;
-  Time globalTime;
-  int* sock_index;
-  std::vector< SocketPoint * > socketsInNetwork;
-  std::vector< WirelessNode * > nodes;
+  static const char MAGIC[8];
 };
 
+const char ScenarioSnapshot::MAGIC[8] = { 'P', 'T', 'P', 'S', 'N', 'A', 'P', '1' };
 
-//-------------------------------------------------X--End of WirelessNetwork Class--X------------------------------------------
+//-------------------------------------------------X--End of ScenarioSnapshot--X------------------------------------------
 
 
 
-//-------------------------------------------------X--Start of Main function--X------------------------------------------
+//-------------------------------------------------X--Start of ScenarioArena Class--X------------------------------------------
 
-int main (int argc, char *argv[])
-{
-  
-  std::string phyMode ("DsssRate1Mbps");
-  double rss = -93;  // -dBm
-  uint32_t packetSize = 1024; // bytes
-  uint8_t interval = 5; // nanoseconds
-  uint32_t users = 6; // Number of users
-  
+// Owns the WirelessNodes and SocketPoints of one scenario. They are built in place in chunked
+// storage that never moves them, so the network keeps plain pointers, and all of them are
+// released in one step when the arena goes out of scope at the end of runScenario.
+class ScenarioArena{
+public:
+  WirelessNode * createNode( uint32_t id, uint32_t masterId, uint16_t hop, Ipv4Address address ){
+    records.emplace_back( address );
+    nodes.emplace_back( id, masterId, hop, &records.back() );
+    return &nodes.back();
+  }
 
-  CommandLine cmd;
+  SocketPoint * createSocketPoint( uint32_t senderId, uint32_t receiverId, Ipv4Address txIp, uint16_t txPort,
+    Ipv4Address recvIp, uint16_t recvPort, Ptr<Socket> sock ){
+    socketPoints.emplace_back( senderId, receiverId, txIp, txPort, recvIp, recvPort, sock );
+    return &socketPoints.back();
+  }
 
-  cmd.AddValue ("phyMode", "Wifi Phy mode", phyMode);
-  cmd.AddValue ("rss", "received signal strength", rss);
-  cmd.AddValue ("packetSize", "size of application packet sent", packetSize);
-  cmd.AddValue ("interval", "interval (seconds) between packets", interval);
-  cmd.AddValue ("users", "Number of receivers", users);
+  // 0 for the constant model, which needs no state
+  OscillatorModel * createOscillator( const OscillatorParams &params ){
+    OscillatorModel *model = makeOscillator( params );
+    if( model != 0 ){
+      oscillators.push_back( std::unique_ptr< OscillatorModel >( model ) );
+    }
+    return model;
+  }
 
-  cmd.Parse (argc, argv);
+  size_t getNumObjects(){
+    return nodes.size() + socketPoints.size() + oscillators.size();
+  }
+
+private:
+  std::deque< WirelessNode > nodes;
+  std::deque< NodeRecord > records; // the cold state of nodes, apart from them
+  std::deque< SocketPoint > socketPoints;
+  std::deque< std::unique_ptr< OscillatorModel > > oscillators;
+};
+
+//-------------------------------------------------X--End of ScenarioArena Class--X------------------------------------------
+
+
+//-------------------------------------------------X--Start of Scenario--X------------------------------------------
+
+// Parameters of one simulation run, set from the command line or by the sweep driver
+struct ScenarioConfig{
+  ScenarioConfig()
+  : phyMode("DsssRate1Mbps"),
+    rss(-93),
+    packetSize(1024),
+    interval(5),
+    users(6),
+    topologyType("chain"),
+    topologyFile(""),
+    treeFanout(2),
+    linkRange(1.5),
+    lazyClocks(true),
+    transparentClock(false),
+    rightSizedFrames(false),
+    oneStep(false),
+    phyTimestamps(false),
+    broadcast(false),
+    slotted(false),
+    slotLength(0),
+    maxRange(0),
+    statsInterval(0),
+    syncRounds(1),
+    syncInterval(1.0),
+    servoKp(0.7),
+    servoKi(0.3),
+    oscillator(),
+    election(false),
+    electionSlot(0.05),
+    electionTime(1.0),
+    grandmasterCandidates(""),
+    masterFailTime(0),
+    syncTimeout(3),
+    stallTimeout(0.1),
+    mobility("static"),
+    mobilityTrace(""),
+    speed(2.0),
+    pause(0),
+    helloInterval(1.0),
+    helloLoss(3),
+    saveSnapshot(""),
+    loadSnapshot(""),
+    traceLevel(TRACE_CHANGED),
+    traceFile("ptp-clock-trace.csv"),
+    capture(true),
+    animation(true),
+    captureStart(0),
+    captureStop(0),
+    captureNodes(""),
+    captureTypes(""),
+    captureBuffer(0),
+    captureTrigger(0),
+    captureFlushAtEnd(false),
+    report(true),
+    profile(false),
+    seed(1),
+    run(1)
+  {
+  }
+
+  std::string phyMode;
+  double rss;  // -dBm
+  uint32_t packetSize; // bytes
+  uint32_t interval; // nanoseconds
+  uint32_t users; // Number of users
+  std::string topologyType;
+  std::string topologyFile;
+  uint32_t treeFanout;
+  double linkRange; // link distance of random geometric graphs, in node spacings
+  bool lazyClocks;
+  bool transparentClock;
+  bool rightSizedFrames;
+  bool oneStep;
+  bool phyTimestamps;
+  bool broadcast;
+  bool slotted;
+  double slotLength; // seconds, 0 sizes the slot automatically
+  double maxRange; // metres, 0 for no limit
+  double statsInterval; // seconds between statistics checkpoints, 0 for none
+  std::string statsFile;
+  uint32_t syncRounds;
+  double syncInterval; // seconds
+  double servoKp;
+  double servoKi;
+  OscillatorParams oscillator;
+  bool election;
+  double electionSlot; // seconds between the self-announce turns of consecutive node ids
+  double electionTime; // seconds from the start of the election to the start of the protocol
+  std::string grandmasterCandidates; // comma separated node ids with a better priority1
+  double masterFailTime; // seconds, 0 for a master that never fails
+  uint32_t syncTimeout; // sync intervals without an exchange before the master counts as lost
+  double stallTimeout; // seconds a sequencer event may wait for a lost packet, broadcast and failover only
+  std::string mobility; // static, waypoint or trace
+  std::string mobilityTrace; // ns-2 movement file of the trace mobility
+  double speed; // m/s, top speed of the random waypoint mobility
+  double pause; // seconds a node rests at every waypoint
+  double helloInterval; // seconds between the HELLOs of the neighbour discovery
+  uint32_t helloLoss; // HELLO intervals without one before a neighbour is dropped
+  std::string saveSnapshot; // file the converged state is written to at the end of the run
+  std::string loadSnapshot; // file of an earlier run whose state this one starts from
+  int traceLevel;
+  std::string traceFile;
+  bool capture; // pcap and NetAnim output
+  bool animation; // the NetAnim file, when capturing
+  double captureStart; // seconds, start of the capture window
+  double captureStop; // seconds, end of the capture window, 0 for the end of the run
+  std::string captureNodes; // comma separated ids of the captured nodes, empty for all
+  std::string captureTypes; // comma separated message types captured, empty for all frames
+  uint32_t captureBuffer; // frames kept in memory and written only on a trigger, 0 to write them all
+  double captureTrigger; // ns, offset error before a correction that flushes the buffer, 0 for none
+  bool captureFlushAtEnd; // also write what is left in the buffer at the end of the run
+  bool report; // print the accuracy report at the end
+  bool profile; // measure the time spent in receivePacket
+  uint32_t seed;
+  uint32_t run;
+
+  // sets a parameter by its command line name, used to apply the points of a sweep. The values of a
+  // sweep axis are separated by commas, so there the ids of grandmasterCandidates are joined by '+'.
+  // A swept seed is kept, the replications of a point only change run.
+  bool set( std::string name, std::string value ){
+    std::stringstream in( value );
+    if( name == "phyMode" ) in >> phyMode;
+    else if( name == "seed" ) in >> seed;
+    else if( name == "lazyClocks" ) in >> lazyClocks;
+    else if( name == "rss" ) in >> rss;
+    else if( name == "packetSize" ) in >> packetSize;
+    else if( name == "interval" ) in >> interval;
+    else if( name == "users" ) in >> users;
+    else if( name == "topology" ) in >> topologyType;
+    else if( name == "topologyFile" ) in >> topologyFile;
+    else if( name == "treeFanout" ) in >> treeFanout;
+    else if( name == "linkRange" ) in >> linkRange;
+    else if( name == "transparentClock" ) in >> transparentClock;
+    else if( name == "rightSizedFrames" ) in >> rightSizedFrames;
+    else if( name == "oneStep" ) in >> oneStep;
+    else if( name == "phyTimestamps" ) in >> phyTimestamps;
+    else if( name == "broadcast" ) in >> broadcast;
+    else if( name == "slotted" ) in >> slotted;
+    else if( name == "slotLength" ) in >> slotLength;
+    else if( name == "maxRange" ) in >> maxRange;
+    else if( name == "statsInterval" ) in >> statsInterval;
+    else if( name == "statsFile" ) in >> statsFile;
+    else if( name == "syncRounds" ) in >> syncRounds;
+    else if( name == "syncInterval" ) in >> syncInterval;
+    else if( name == "servoKp" ) in >> servoKp;
+    else if( name == "servoKi" ) in >> servoKi;
+    else if( name == "oscillator" ) in >> oscillator.model;
+    else if( name == "oscillatorStep" ) in >> oscillator.step;
+    else if( name == "walkPpb" ) in >> oscillator.walkPpb;
+    else if( name == "temperatureSwing" ) in >> oscillator.temperatureSwing;
+    else if( name == "temperaturePeriod" ) in >> oscillator.temperaturePeriod;
+    else if( name == "allanWhitePpb" ) in >> oscillator.allanWhitePpb;
+    else if( name == "allanWalkPpb" ) in >> oscillator.allanWalkPpb;
+    else if( name == "election" ) in >> election;
+    else if( name == "electionSlot" ) in >> electionSlot;
+    else if( name == "electionTime" ) in >> electionTime;
+    else if( name == "grandmasterCandidates" ){
+      in >> grandmasterCandidates;
+      std::replace( grandmasterCandidates.begin(), grandmasterCandidates.end(), '+', ',' );
+    }
+    else if( name == "masterFailTime" ) in >> masterFailTime;
+    else if( name == "syncTimeout" ) in >> syncTimeout;
+    else if( name == "stallTimeout" ) in >> stallTimeout;
+    else if( name == "mobility" ) in >> mobility;
+    else if( name == "mobilityTrace" ) in >> mobilityTrace;
+    else if( name == "speed" ) in >> speed;
+    else if( name == "pause" ) in >> pause;
+    else if( name == "helloInterval" ) in >> helloInterval;
+    else if( name == "helloLoss" ) in >> helloLoss;
+    else if( name == "loadSnapshot" ) in >> loadSnapshot;
+    else if( name == "capture" ) in >> capture;
+    else if( name == "animation" ) in >> animation;
+    else if( name == "captureStart" ) in >> captureStart;
+    else if( name == "captureStop" ) in >> captureStop;
+    else if( name == "captureNodes" ) in >> captureNodes;
+    else if( name == "captureTypes" ) in >> captureTypes;
+    else if( name == "captureBuffer" ) in >> captureBuffer;
+    else if( name == "captureTrigger" ) in >> captureTrigger;
+    else if( name == "captureFlushAtEnd" ) in >> captureFlushAtEnd;
+    else return false;
+    return !in.fail();
+  }
+};
+
+// Builds the network described by config, runs the simulation and collects its metrics.
+// Returns non-zero if the scenario cannot be set up.
+int runScenario( const ScenarioConfig &config, ScenarioMetrics &metrics )
+{
+  std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+  uint32_t users = config.users;
+
+  // make every replication reproducible: ns-3 streams and the clock errors drawn with rand()
+  RngSeedManager::SetSeed( config.seed );
+  RngSeedManager::SetRun( config.run );
+  srand( config.seed * 1000003u + config.run );
+
+  // Build the topology and derive hop and master of every node from it
+  Topology topology;
+  ScenarioSnapshot snapshot;
+  if( config.loadSnapshot != "" ){
+    if( !snapshot.load( config.loadSnapshot ) ){
+      return 1;
+    }
+    topology = snapshot.topology;
+    users = topology.getNumNodes();
+  }else if( config.topologyFile != "" ){
+    if( !topology.loadFromFile( config.topologyFile ) ){
+      return 1;
+    }
+    users = topology.getNumNodes();
+  }else if( config.topologyType == "chain" ){
+    topology.makeChain( users );
+  }else if( config.topologyType == "tree" ){
+    topology.makeTree( users, std::max( config.treeFanout, (uint32_t) 1 ) );
+  }else if( config.topologyType == "grid" ){
+    topology.makeGrid( users );
+  }else if( config.topologyType == "random" ){
+    topology.makeRandomGeometric( users, config.linkRange );
+  }else{
+    std::cerr << "unknown topology " << config.topologyType << std::endl;
+    return 1;
+  }
+  bool mobile = config.mobility != "static";
+  if( config.mobility != "static" && config.mobility != "waypoint" && config.mobility != "trace" ){
+    std::cerr << "unknown mobility " << config.mobility << std::endl;
+    return 1;
+  }
+  // unicast sockets are bound to the neighbours of the topology, and without a range limit every
+  // node stays in reach of every other
+  if( mobile && ( !config.broadcast || config.maxRange <= 0 || config.helloInterval <= 0 ) ){
+    std::cerr << "mobility needs broadcast, a maxRange and a helloInterval" << std::endl;
+    return 1;
+  }
+  if( config.mobility == "trace" && config.mobilityTrace == "" ){
+    std::cerr << "trace mobility needs a mobilityTrace file" << std::endl;
+    return 1;
+  }
+  if( !isOscillatorModel( config.oscillator.model ) || config.oscillator.step <= 0 ){
+    std::cerr << "unknown oscillator model " << config.oscillator.model << " or step " << config.oscillator.step << std::endl;
+    return 1;
+  }
+  if( users < 2 ){
+    std::cerr << "the topology needs at least two nodes" << std::endl;
+    return 1;
+  }
+  // rooted at the master of a snapshot, so that hops and oscillators match its tree
+  uint32_t unreachable = topology.computeSyncTree( config.loadSnapshot != "" ? snapshot.masterIndex : 0 );
+  if( unreachable > 0 ){
+    std::cerr << unreachable << " nodes cannot reach the master and stay unsynchronized" << std::endl;
+  }
 
   // Convert to time object
-  Time interPacketInterval = NanoSeconds (interval);
+  Time interPacketInterval = NanoSeconds (config.interval);
   // disable fragmentation for frames below 2200 bytes
   Config::SetDefault ("ns3::WifiRemoteStationManager::FragmentationThreshold",
     StringValue ("2200"));
@@ -884,7 +4610,7 @@ int main (int argc, char *argv[])
 
   // Fix non-unicast data rate to be the same as that of unicast
   Config::SetDefault ("ns3::WifiRemoteStationManager::NonUnicastMode",
-    StringValue (phyMode));
+    StringValue (config.phyMode));
 
   // Source and destination
   NodeContainer nodes;
@@ -910,13 +4636,18 @@ int main (int argc, char *argv[])
   // The below FixedRssLossModel will cause the rss to be fixed regardless
   // of the distance between the two stations, and the transmit power
   wifiChannel.AddPropagationLoss ("ns3::FixedRssLossModel","Rss",
-    DoubleValue (rss));
+    DoubleValue (config.rss));
+  // without a range limit every node hears every other and the network is a single collision domain
+  if( config.maxRange > 0 ){
+    wifiChannel.AddPropagationLoss ("ns3::RangePropagationLossModel","MaxRange",
+      DoubleValue (config.maxRange));
+  }
   wifiPhy.SetChannel (wifiChannel.Create ());
 
   // Add a non-QoS upper mac, and disable rate control
   NqosWifiMacHelper wifiMac = NqosWifiMacHelper::Default ();
   wifi.SetRemoteStationManager ("ns3::ConstantRateWifiManager",
-    "DataMode",StringValue (phyMode), "ControlMode",StringValue (phyMode));
+    "DataMode",StringValue (config.phyMode), "ControlMode",StringValue (config.phyMode));
 
   // Set WiFi type and configuration parameters for MAC
   // Set it to adhoc mode
@@ -932,87 +4663,108 @@ int main (int argc, char *argv[])
   Ptr<ListPositionAllocator> positionAlloc =
     CreateObject<ListPositionAllocator> ();
 
-  for (uint32_t n = 1; n <= users; n++)
+  for (uint32_t n = 0; n < users; n++)
     {
-      positionAlloc->Add (Vector (5.0, 5.0*n, 0.0));
+      positionAlloc->Add (topology.getPosition (n));
     }
 
   mobility.SetPositionAllocator (positionAlloc);
-  mobility.SetMobilityModel ("ns3::ConstantPositionMobilityModel");
-  mobility.Install (nodes);
+  if( config.mobility == "waypoint" ){
+    // waypoints anywhere in the area the topology covers
+    double width = 0, height = 0;
+    for (uint32_t n = 0; n < users; n++){
+      width = std::max( width, topology.getPosition (n).x );
+      height = std::max( height, topology.getPosition (n).y );
+    }
+    std::stringstream x, y, speed, pause;
+    x << "ns3::UniformRandomVariable[Min=0.0|Max=" << width << "]";
+    y << "ns3::UniformRandomVariable[Min=0.0|Max=" << height << "]";
+    speed << "ns3::UniformRandomVariable[Min=" << config.speed / 10 << "|Max=" << config.speed << "]";
+    pause << "ns3::ConstantRandomVariable[Constant=" << config.pause << "]";
+    Ptr<RandomRectanglePositionAllocator> waypoints = CreateObject<RandomRectanglePositionAllocator> ();
+    waypoints->SetAttribute ("X", StringValue (x.str ()));
+    waypoints->SetAttribute ("Y", StringValue (y.str ()));
+    mobility.SetMobilityModel ("ns3::RandomWaypointMobilityModel", "Speed", StringValue (speed.str ()),
+      "Pause", StringValue (pause.str ()), "PositionAllocator", PointerValue (waypoints));
+    mobility.Install (nodes);
+  }else if( config.mobility == "trace" ){
+    // the trace numbers the nodes as they were created, the first users ones are ours
+    Ns2MobilityHelper ns2 (config.mobilityTrace);
+    ns2.Install ();
+  }else{
+    mobility.SetMobilityModel ("ns3::ConstantPositionMobilityModel");
+    mobility.Install (nodes);
+  }
   InternetStackHelper internet;
   internet.Install (nodes);
 
+  // one /8 subnet so that addresses scale to millions of nodes
   Ipv4AddressHelper ipv4;
-  ipv4.SetBase ("10.1.1.0", "255.255.255.0");
+  ipv4.SetBase ("10.0.0.0", "255.0.0.0");
   ipv4.Assign (devices);
   TypeId tid = TypeId::LookupByName ("ns3::UdpSocketFactory");
 
-  char ipv4Add[6][12] = { "10.1.1.1", "10.1.1.2" , "10.1.1.3", "10.1.1.4", "10.1.1.5", "10.1.1.6"};
-  uint16_t connectToPortAtNode[6] = { 100, 200, 300, 400, 500, 600 };
-  uint16_t hopOfNode[6] = { 0, 1, 2, 3, 4, 5 };
-  uint32_t masterOfNode[6] = { 1, 1, 2, 3, 4, 5 };
-  int socketIndex[7];
-
-  int neighbourList[6][3] = {
-    { 2, -1},
-    { 1, 3, -1},
-    { 2, 4, -1},
-    { 3, 5, -1},
-    { 4, 6, -1},
-    { 5, -1}
-  };
-
-  uint16_t neighbourPort[6][3] = {
-    { 200 },
-    { 100, 300 },
-    { 201, 400 },
-    { 301, 500 },
-    { 401, 600 },
-    { 501 }
-  };
+  // the socket towards the j-th neighbour of a node is bound to port basePort + j of that node
+  const uint16_t basePort = 100;
+  std::vector< int > socketIndex( users + 1 );
 
   std::vector< WirelessNode * > staticNodes(users);
   std::vector<Ipv4Address> ipv4Address( users );
   std::vector<int> neighbourNode;
   std::vector< std::vector < Ptr<Socket> > >  neighbour( users );
-  std::vector< SocketPoint * > socketPoint(10);
-  uint16_t i,j,k,l,count_Socket=0,myPort; 
+  std::vector< SocketPoint * > socketPoint;
+  uint32_t i,j,k,count_Socket=0,neighbourIndex;
+  uint16_t myPort, neighbourPort;
 
-  // create Ipv4 address 
+  // create Ipv4 address, in the order ipv4.Assign handed them out
   for( i=0; i < users;i++){
-    ipv4Address[i] = Ipv4Address(ipv4Add[i]);
+    ipv4Address[i] = Ipv4Address( Ipv4Address("10.0.0.0").Get() + i + 1 );
   }
 
   // pass adjacency list in vector
-  for( k=0;k<3;k++){
-    l=0;
-    while( l < 2 && neighbourList[k][l] != -1 ){
-      neighbourNode.push_back( neighbourList[k][l] );
-      l++;
+  for( i=0; i < users; i++){
+    for( j=0; j < topology.getNumNeighbour(i); j++){
+      neighbourNode.push_back( topology.getNeighbour(i, j) + 1 );
     }
     neighbourNode.push_back(-1);
   }
 
-  WirelessNetwork ptpTest(users, neighbourNode, packetSize, interPacketInterval);
+  // declared before the network so that they outlive it
+  ScenarioArena arena;
+  PacketCapture capture;
+  WirelessNetwork ptpTest(users, neighbourNode, config.packetSize, interPacketInterval);
   
   socketIndex[0] = -1;
-  for ( i = 0; i < users; i++)
+  // broadcast: a single socket per node on basePort, its index in socketPoint is the node index
+  for ( i = 0; config.broadcast && i < users; i++)
     {
-      j=0;
-      while( neighbourList[i][j] != -1 && j < 3 ){
+      neighbour[i].push_back( Socket::CreateSocket (nodes.Get(i), tid) );
+      neighbour[i][0]->SetAllowBroadcast( true );
+      neighbour[i][0]->Bind( InetSocketAddress( Ipv4Address::GetAny (), basePort ) );
+      neighbour[i][0]->Connect( InetSocketAddress( Ipv4Address::GetBroadcast (), basePort ) );
+      neighbour[i][0]->SetRecvCallback (MakeBoundCallback (&receiveAtSocketPoint,
+        &ptpTest, (uint32_t) i));
+      socketPoint.push_back( arena.createSocketPoint(i+1, 0, ipv4Address[i], basePort, Ipv4Address::GetBroadcast (),
+        basePort, neighbour[i][0]) );
+      staticNodes[i] = arena.createNode( i+1, topology.getMaster(i), topology.getHop(i), ipv4Address[i] );
+      socketIndex[i+1] = i;
+    }
+  for ( i = 0; !config.broadcast && i < users; i++)
+    {
+      for( j=0; j < topology.getNumNeighbour(i); j++ ){
+        neighbourIndex = topology.getNeighbour(i, j);
         neighbour[i].push_back(Socket::CreateSocket (nodes.Get(i), tid) );
-        myPort = connectToPortAtNode[i] + j;
+        myPort = basePort + j;
+        neighbourPort = basePort + topology.getNeighbourPosition( neighbourIndex, i );
         neighbour[i][j]->Bind( InetSocketAddress( ipv4Address[ i ], myPort ) );
-        neighbour[i][j]->Connect ( InetSocketAddress( ipv4Address[ neighbourList[i][j] - 1 ], neighbourPort[i][j] ) );
-        neighbour[i][j]->SetRecvCallback (MakeCallback (&WirelessNetwork::receivePacket,
-        &ptpTest));
-        socketPoint[count_Socket] = new SocketPoint(i+1, neighbourList[i][j], ipv4Address[i],myPort,ipv4Address[ neighbourList[i][j] - 1 ], 
-          neighbourPort[i][j], neighbour[i][j]);
+        neighbour[i][j]->Connect ( InetSocketAddress( ipv4Address[ neighbourIndex ], neighbourPort ) );
+        neighbour[i][j]->SetRecvCallback (MakeBoundCallback (&receiveAtSocketPoint,
+        &ptpTest, (uint32_t) count_Socket));
+        socketPoint.push_back( arena.createSocketPoint(i+1, neighbourIndex+1, ipv4Address[i],myPort,ipv4Address[ neighbourIndex ], 
+          neighbourPort, neighbour[i][j]) );
         count_Socket++;
-        j++;
       }
-      staticNodes[i] = new WirelessNode( i+1, masterOfNode[i], hopOfNode[i], ipv4Address[i] );
+      staticNodes[i] = arena.createNode( i+1, topology.getMaster(i), topology.getHop(i), ipv4Address[i] );
       for( k = socketIndex[i]+1; k < count_Socket; k++ ){
         staticNodes[i]->addNeighbourIndex(k);
       }
@@ -1020,25 +4772,781 @@ int main (int argc, char *argv[])
     }
     
 
-  ptpTest.SetSocketIndex( socketIndex );
+  ptpTest.SetSocketIndex( &socketIndex[0] );
   ptpTest.SetSocketPoint( socketPoint );
+  ptpTest.SetLazyClocks( config.lazyClocks );
+  ptpTest.SetProfiling( config.profile );
+  for( i=0; i < users; i++){
+    if( topology.getHop(i) > 0 ){
+      staticNodes[i]->setOscillator( arena.createOscillator( config.oscillator ) );
+    }
+  }
   ptpTest.addNodesToNetwork( staticNodes );
+  // the report, the trace rows, the steady-state accuracy and the snapshot read them
+  ptpTest.SetNodeStatistics( config.report || config.traceLevel >= TRACE_CHANGED || config.syncRounds > 1 || config.saveSnapshot != "" );
+  ptpTest.SetTransparentClock( config.transparentClock );
+  ptpTest.SetBroadcast( config.broadcast );
+  ptpTest.SetFrameSizing( config.rightSizedFrames, config.phyMode );
+  ptpTest.SetOneStep( config.oneStep );
+  ptpTest.SetPhyTimestamps( config.phyTimestamps );
+  if( config.loadSnapshot != "" ){
+    ptpTest.restoreSnapshot( snapshot.nodes, snapshot.masterIndex );
+  }
+  if( config.slotted ){
+    std::vector< uint32_t > colors;
+    uint32_t numColors = topology.colorTwoHop( colors );
+    ptpTest.SetSlotSchedule( colors, numColors, Seconds( config.slotLength ) );
+    if( config.report ){
+      std::cout << "Slotted exchanges: " << numColors << " slots of " << ptpTest.getSlotLength().GetMicroSeconds() << " us" << std::endl;
+    }
+  }
+  for( i=0; config.phyTimestamps && i < users; i++){
+    Ptr<WifiPhy> phy = DynamicCast<WifiNetDevice>( devices.Get(i) )->GetPhy();
+    phy->TraceConnectWithoutContext( "PhyTxBegin", MakeBoundCallback( &phyTxBeginAt, &ptpTest, i ) );
+    phy->TraceConnectWithoutContext( "PhyRxBegin", MakeBoundCallback( &phyRxBeginAt, &ptpTest, i ) );
+  }
+  ptpTest.SetTrace( config.traceLevel, config.traceFile );
+  if( !ptpTest.SetStatistics( Seconds( config.statsInterval ), config.statsFile ) ){
+    Simulator::Destroy ();
+    return 1;
+  }
+  ptpTest.SetPeriodicSync( config.syncRounds, Seconds( config.syncInterval ), config.servoKp, config.servoKi );
+  ptpTest.SetStallTimeout( Seconds( config.stallTimeout ) );
+  Time protocolStart = Seconds (1.0);
+  if( config.masterFailTime > 0 && config.syncRounds < 2 ){
+    std::cerr << "a master failure needs periodic sync, set syncRounds above 1" << std::endl;
+    Simulator::Destroy ();
+    return 1;
+  }
+  if( config.election || config.masterFailTime > 0 || mobile ){
+    std::vector< uint8_t > priorities( users, WirelessNetwork::DEFAULT_PRIORITY );
+    std::stringstream candidates( config.grandmasterCandidates );
+    std::string candidate;
+    while( std::getline( candidates, candidate, ',' ) ){
+      uint32_t id = atoi( candidate.c_str() );
+      if( id < 1 || id > users ){
+        std::cerr << "grandmaster candidate " << candidate << " is not a node" << std::endl;
+        Simulator::Destroy ();
+        return 1;
+      }
+      priorities[id-1] = WirelessNetwork::DEFAULT_PRIORITY / 2;
+    }
+    ptpTest.SetElection( priorities, Seconds( config.electionSlot ), Seconds( config.electionTime ) );
+    ptpTest.SetMasterFailure( Seconds( config.masterFailTime ), config.syncRounds > 1 ? config.syncTimeout : 0 );
+  }
+  if( config.election ){
+    Simulator::Schedule( protocolStart, &WirelessNetwork::startElection, &ptpTest );
+    protocolStart += Seconds( config.electionTime );
+  }
+  if( mobile ){
+    ptpTest.SetMobility( Seconds( config.helloInterval ), config.helloLoss );
+    // the mobility models schedule movements forever
+    Simulator::Stop( protocolStart + Seconds( config.syncInterval * ( config.syncRounds + 1 ) ) );
+  }
   // Turn on global static routing so we can be routed across the network
   Ipv4GlobalRoutingHelper::PopulateRoutingTables ();
-  // Pcap tracing
-  wifiPhy.EnablePcap ("ptp-wifi-broadcast", devices);
+  // Pcap tracing: the helper's full capture of every device, or our own with a window, a type
+  // filter or a ring buffer
+  std::vector< bool > captured( users, config.captureNodes == "" );
+  std::stringstream captureIds( config.captureNodes );
+  std::string captureId;
+  while( std::getline( captureIds, captureId, ',' ) ){
+    uint32_t id = atoi( captureId.c_str() );
+    if( id < 1 || id > users ){
+      std::cerr << "captured node " << captureId << " is not a node" << std::endl;
+      Simulator::Destroy ();
+      return 1;
+    }
+    captured[id-1] = true;
+  }
+  uint32_t captureTypes = 0;
+  std::stringstream captureNames( config.captureTypes );
+  std::string captureName;
+  while( std::getline( captureNames, captureName, ',' ) ){
+    int m = 0;
+    while( m < NUM_MSG_TYPES && captureName != msgTypeName(m) ){
+      m++;
+    }
+    if( m == NUM_MSG_TYPES ){
+      std::cerr << "unknown message type " << captureName << " to capture" << std::endl;
+      Simulator::Destroy ();
+      return 1;
+    }
+    captureTypes |= 1u << m;
+  }
+  bool filtered = config.captureStart > 0 || config.captureStop > 0 || captureTypes != 0 || config.captureBuffer > 0;
+  for( i=0; config.capture && !filtered && i < users; i++){
+    if( captured[i] ){
+      wifiPhy.EnablePcap ("ptp-wifi-broadcast", devices.Get(i));
+    }
+  }
+  if( config.capture && filtered ){
+    if( !capture.open( "ptp-wifi-capture.pcap", captured, captureTypes, Seconds( config.captureStart ),
+        Seconds( config.captureStop ), config.captureBuffer, config.captureTrigger, config.captureFlushAtEnd ) ){
+      Simulator::Destroy ();
+      return 1;
+    }
+    ptpTest.SetCapture( &capture );
+    for( i=0; i < users; i++){
+      if( captured[i] ){
+        Ptr<WifiPhy> phy = DynamicCast<WifiNetDevice>( devices.Get(i) )->GetPhy();
+        phy->TraceConnectWithoutContext( "PhyTxBegin", MakeBoundCallback( &captureTxBeginAt, &capture, i ) );
+      }
+    }
+  }
 
-  Simulator::ScheduleWithContext (neighbour[0][0]->GetNode ()->GetId (), Seconds (1.0),
+  Simulator::ScheduleWithContext (nodes.Get (0)->GetId (), protocolStart,
     &WirelessNetwork::startProtocol, &ptpTest);
 
-  AnimationInterface anim( "modified-ptp-test.xml");
-  anim.SetConstantPosition( nodes.Get(0), 0.0, 15.0);
-  anim.SetConstantPosition( nodes.Get(1), 4.0, 15.0);
-  anim.SetConstantPosition( nodes.Get(2), 8.0, 15.0);
-  anim.SetConstantPosition( nodes.Get(3), 12.0, 15.0);
-  anim.SetConstantPosition( nodes.Get(4), 16.0, 15.0);
-  anim.SetConstantPosition( nodes.Get(5), 20.0, 15.0);
+  // NetAnim records every node, only the window applies to it
+  AnimationInterface * anim = 0;
+  if( config.capture && config.animation ){
+    anim = new AnimationInterface( "modified-ptp-test.xml");
+    anim->SetStartTime( Seconds( config.captureStart ) );
+    if( config.captureStop > 0 ){
+      anim->SetStopTime( Seconds( config.captureStop ) );
+    }
+    for( i=0; !mobile && i < users; i++){
+      anim->SetConstantPosition( nodes.Get(i), topology.getPosition(i).x, topology.getPosition(i).y);
+    }
+  }
   Simulator::Run ();
+  capture.close();
+  ptpTest.closeTrace();
+  ptpTest.closeStatistics();
+  ptpTest.collectMetrics( metrics );
+  metrics.values[METRIC_EVENTS] = Simulator::GetEventCount();
+  metrics.values[METRIC_WALL_TIME] = std::chrono::duration<double>( std::chrono::steady_clock::now() - wallStart ).count();
+  if( config.report && config.syncRounds > 1 ){
+    ptpTest.printAccuracyReport( std::cout );
+  }
+  if( config.report && config.election ){
+    ptpTest.printElectionReport( std::cout );
+  }
+  if( config.report && config.masterFailTime > 0 ){
+    ptpTest.printFailoverReport( std::cout );
+  }
+  if( config.report && mobile ){
+    ptpTest.printMobilityReport( std::cout );
+  }
+  if( config.report && config.capture && filtered ){
+    capture.printReport( std::cout );
+  }
+  if( config.saveSnapshot != "" ){
+    ScenarioSnapshot converged;
+    converged.topology = topology;
+    converged.masterIndex = ptpTest.getMasterIndex();
+    ptpTest.getSnapshot( converged.nodes );
+    if( !converged.save( config.saveSnapshot ) ){
+      delete anim;
+      Simulator::Destroy ();
+      return 1;
+    }
+  }
+  if( metrics.values[METRIC_SEND_FAILURES] > 0 ){
+    std::cerr << metrics.values[METRIC_SEND_FAILURES] << " packets could not be sent" << std::endl;
+  }
+  if( config.report ){
+    ptpTest.printAirtimeReport( std::cout );
+    ptpTest.printStatistics( std::cout );
+    std::cout << "Node state: " << metrics.values[METRIC_NODE_MEMORY] << " bytes per node, " << sizeof( WirelessNode )
+      << " of them read on every clock access" << std::endl;
+  }
+  delete anim;
   Simulator::Destroy ();
   return 0;
 }
+
+// Runs count scenarios back to back in this process with the runs config.run, config.run+1, ...
+// and prints the peak RSS after each one. Every scenario releases what it allocated, so after
+// the first run the peak stays flat.
+int runBatch( ScenarioConfig config, uint32_t count ){
+  config.report = false;
+  config.traceLevel = TRACE_OFF;
+  config.capture = false;
+  config.statsInterval = 0;
+  config.statsFile = "";
+  uint32_t firstRun = config.run;
+  std::cout << "run,sync_time_s,synced_fraction,wall_time_s,peak_rss_mb" << '\n';
+  for( uint32_t k = 0; k < count; k++ ){
+    config.run = firstRun + k;
+    ScenarioMetrics metrics;
+    if( runScenario( config, metrics ) != 0 ){
+      return 1;
+    }
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    std::cout << config.run << ',' << metrics.values[METRIC_SYNC_TIME] << ',' << metrics.values[METRIC_SYNCED_FRACTION]
+              << ',' << metrics.values[METRIC_WALL_TIME] << ',' << usage.ru_maxrss / 1024.0 << std::endl;
+  }
+  return 0;
+}
+
+//-------------------------------------------------X--End of Scenario--X------------------------------------------
+
+
+//-------------------------------------------------X--Start of SweepRunner Class--X------------------------------------------
+
+// Runs every point of a parameter grid a number of times with different RNG runs. Each run is a
+// forked worker process, at most jobs of them at a time, which sends its metrics back through a
+// pipe. Results are written per run and aggregated per point (mean and 95% confidence interval).
+class SweepRunner{
+public:
+  SweepRunner( const ScenarioConfig &base, uint32_t replications, uint32_t jobs )
+  : baseConfig(base),
+    numReplications( std::max( replications, (uint32_t) 1 ) ),
+    maxJobs(jobs)
+  {
+    if( maxJobs == 0 ){
+      long cores = sysconf( _SC_NPROCESSORS_ONLN );
+      maxJobs = cores > 0 ? cores : 1;
+    }
+    // workers must not write traces, captures or reports over each other
+    baseConfig.traceLevel = TRACE_OFF;
+    baseConfig.capture = false;
+    baseConfig.report = false;
+    baseConfig.statsInterval = 0;
+    baseConfig.statsFile = "";
+  }
+
+  // grid: "name=v1,v2,...;name=v1,..." with the names of the command line parameters
+  bool parseGrid( std::string grid ){
+    std::stringstream gridStream( grid );
+    std::string axis, value;
+    ScenarioConfig probe;
+    while( std::getline( gridStream, axis, ';' ) ){
+      size_t equals = axis.find( '=' );
+      if( equals == std::string::npos ){
+        std::cerr << "sweep axis '" << axis << "' is not name=values" << std::endl;
+        return false;
+      }
+      names.push_back( axis.substr( 0, equals ) );
+      values.push_back( std::vector< std::string >() );
+      std::stringstream valueStream( axis.substr( equals + 1 ) );
+      while( std::getline( valueStream, value, ',' ) ){
+        if( !probe.set( names.back(), value ) ){
+          std::cerr << "cannot sweep " << names.back() << " over '" << value << "'" << std::endl;
+          return false;
+        }
+        values.back().push_back( value );
+      }
+      if( values.back().empty() ){
+        std::cerr << "sweep axis " << names.back() << " has no values" << std::endl;
+        return false;
+      }
+    }
+    return !names.empty();
+  }
+
+  int run( std::string outputFile ){
+    uint32_t numPoints = 1;
+    for( size_t a = 0; a < values.size(); a++ ){
+      numPoints *= values[a].size();
+    }
+    uint32_t numRuns = numPoints * numReplications;
+    results.assign( numRuns, ScenarioMetrics() );
+    succeeded.assign( numRuns, false );
+
+    std::map< pid_t, std::pair< uint32_t, int > > running; // pid -> (run index, read end of its pipe)
+    uint32_t next = 0, done = 0;
+    std::cerr << "sweep: " << numPoints << " points x " << numReplications << " replications on " << maxJobs << " workers" << std::endl;
+
+    while( done < numRuns ){
+      while( next < numRuns && running.size() < maxJobs ){
+        int fds[2];
+        if( pipe( fds ) != 0 ){
+          std::cerr << "sweep: cannot create pipe" << std::endl;
+          return 1;
+        }
+        std::cout.flush();
+        std::cerr.flush();
+        pid_t pid = fork();
+        if( pid == 0 ){
+          close( fds[0] );
+          _exit( runWorker( next, fds[1] ) );
+        }
+        close( fds[1] );
+        if( pid < 0 ){
+          close( fds[0] );
+          std::cerr << "sweep: cannot fork" << std::endl;
+          return 1;
+        }
+        running[pid] = std::make_pair( next, fds[0] );
+        next++;
+      }
+
+      int status;
+      struct rusage usage;
+      pid_t pid = wait4( -1, &status, 0, &usage );
+      if( pid < 0 ){
+        break;
+      }
+      std::map< pid_t, std::pair< uint32_t, int > >::iterator it = running.find( pid );
+      if( it == running.end() ){
+        continue;
+      }
+      uint32_t index = it->second.first;
+      succeeded[index] = WIFEXITED( status ) && WEXITSTATUS( status ) == 0 && readMetrics( it->second.second, results[index] );
+      results[index].values[METRIC_PEAK_RSS] = usage.ru_maxrss / 1024.0; // kilobytes on Linux
+      close( it->second.second );
+      running.erase( it );
+      done++;
+      if( !succeeded[index] ){
+        std::cerr << "sweep: run " << index << " failed" << std::endl;
+      }
+      if( done % 10 == 0 || done == numRuns ){
+        std::cerr << "sweep: " << done << "/" << numRuns << " runs done" << std::endl;
+      }
+    }
+
+    if( outputFile != "" ){
+      writeRuns( outputFile + ".runs.csv", numRuns );
+      writeAggregate( outputFile, numPoints );
+    }
+    return 0;
+  }
+
+  // value of swept parameter axis at run index
+  std::string getRunParameter( uint32_t index, uint32_t axis ){
+    uint32_t point = index / numReplications;
+    for( size_t a = values.size(); a-- > axis + 1; ){
+      point /= values[a].size();
+    }
+    return values[axis][ point % values[axis].size() ];
+  }
+
+  uint32_t getNumRuns(){
+    return results.size();
+  }
+
+  bool isRunSucceeded( uint32_t index ){
+    return succeeded[index];
+  }
+
+  const ScenarioMetrics & getRunMetrics( uint32_t index ){
+    return results[index];
+  }
+
+private:
+  // configuration of run index: point index / replications, RNG run index % replications + 1
+  ScenarioConfig configOf( uint32_t index ){
+    ScenarioConfig config = baseConfig;
+    uint32_t point = index / numReplications;
+    for( size_t a = values.size(); a-- > 0; ){
+      config.set( names[a], values[a][ point % values[a].size() ] );
+      point /= values[a].size();
+    }
+    config.run = baseConfig.run + index % numReplications;
+    return config;
+  }
+
+  int runWorker( uint32_t index, int fd ){
+    ScenarioMetrics metrics;
+    if( runScenario( configOf( index ), metrics ) != 0 ){
+      return 1;
+    }
+    std::stringstream line;
+    line << std::setprecision(17);
+    for( int m = 0; m < NUM_METRICS; m++ ){
+      line << metrics.values[m] << ' ';
+    }
+    line << '\n';
+    std::string text = line.str();
+    size_t written = 0;
+    while( written < text.size() ){
+      ssize_t n = write( fd, text.c_str() + written, text.size() - written );
+      if( n <= 0 ){
+        return 1;
+      }
+      written += n;
+    }
+    close( fd );
+    return 0;
+  }
+
+  bool readMetrics( int fd, ScenarioMetrics &metrics ){
+    std::string text;
+    char chunk[512];
+    ssize_t n;
+    while( ( n = read( fd, chunk, sizeof(chunk) ) ) > 0 ){
+      text.append( chunk, n );
+    }
+    std::stringstream in( text );
+    for( int m = 0; m < NUM_METRICS; m++ ){
+      in >> metrics.values[m];
+    }
+    return !in.fail();
+  }
+
+  void writeParameters( std::ostream &out, uint32_t index ){
+    for( size_t a = 0; a < values.size(); a++ ){
+      out << getRunParameter( index, a ) << ',';
+    }
+  }
+
+  void writeRuns( std::string fileName, uint32_t numRuns ){
+    std::ofstream out( fileName.c_str() );
+    for( size_t a = 0; a < names.size(); a++ ){
+      out << names[a] << ',';
+    }
+    out << "seed,run,ok";
+    for( int m = 0; m < NUM_METRICS; m++ ){
+      out << ',' << ScenarioMetrics::name(m);
+    }
+    out << '\n';
+    for( uint32_t index = 0; index < numRuns; index++ ){
+      ScenarioConfig config = configOf( index );
+      writeParameters( out, index );
+      out << config.seed << ',' << config.run << ',' << succeeded[index];
+      for( int m = 0; m < NUM_METRICS; m++ ){
+        out << ',' << results[index].values[m];
+      }
+      out << '\n';
+    }
+  }
+
+  void writeAggregate( std::string fileName, uint32_t numPoints ){
+    std::ofstream out( fileName.c_str() );
+    for( size_t a = 0; a < names.size(); a++ ){
+      out << names[a] << ',';
+    }
+    out << "runs";
+    for( int m = 0; m < NUM_METRICS; m++ ){
+      out << ',' << ScenarioMetrics::name(m) << "_mean," << ScenarioMetrics::name(m) << "_ci95";
+    }
+    out << '\n';
+    for( uint32_t point = 0; point < numPoints; point++ ){
+      uint32_t first = point * numReplications, n = 0;
+      writeParameters( out, first );
+      for( uint32_t r = first; r < first + numReplications; r++ ){
+        n += succeeded[r];
+      }
+      out << n;
+      for( int m = 0; m < NUM_METRICS; m++ ){
+        double sum = 0, squareSum = 0;
+        for( uint32_t r = first; r < first + numReplications; r++ ){
+          if( succeeded[r] ){
+            sum += results[r].values[m];
+            squareSum += results[r].values[m] * results[r].values[m];
+          }
+        }
+        double mean = n ? sum / n : 0;
+        double variance = n > 1 ? std::max( 0.0, ( squareSum - n * mean * mean ) / ( n - 1 ) ) : 0;
+        out << ',' << mean << ',' << studentT95( n ) * std::sqrt( variance / std::max( n, (uint32_t) 1 ) );
+      }
+      out << '\n';
+    }
+  }
+
+  // two-sided 95% quantile of Student's t distribution with n - 1 degrees of freedom
+  static double studentT95( uint32_t n ){
+    static const double t[] = { 0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+      2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+      2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+    if( n < 2 ){
+      return 0;
+    }
+    return n - 1 <= 30 ? t[n - 1] : 1.960;
+  }
+
+  ScenarioConfig baseConfig;
+  uint32_t numReplications;
+  uint32_t maxJobs;
+  std::vector< std::string > names;                   // swept parameters
+  std::vector< std::vector< std::string > > values;   // values of every swept parameter
+  std::vector< ScenarioMetrics > results;             // indexed by run
+  std::vector< bool > succeeded;
+};
+
+//-------------------------------------------------X--End of SweepRunner Class--X------------------------------------------
+
+
+//-------------------------------------------------X--Start of BenchmarkRunner Class--X------------------------------------------
+
+// Runs the protocol on chain, tree and mesh (grid) topologies of increasing size, one worker
+// process at a time so the timings do not disturb each other, and reports wall time, simulator
+// events and packets per second, peak RSS and the time spent in receivePacket. A point only
+// counts as run if every packet was sent and every node synchronized. The topologies run with the
+// transparent clock: otherwise a DREQ carries 24 bytes per hop and deep in a long chain exceeds
+// the largest UDP datagram. Results can be saved as a baseline; a run against a baseline fails
+// when a point that ran there fails, is missing from it or got worse by more than the tolerance.
+// A baseline must hold measured timings for every point that ran, recorded on the same machine.
+class BenchmarkRunner{
+public:
+  BenchmarkRunner( const ScenarioConfig &base, std::string sizes, double tolerance )
+  : runner( base, 1, 1 ),
+    sizeList(sizes),
+    maxRegression(tolerance)
+  {
+  }
+
+  int run( std::string outputFile, std::string baselineFile ){
+    if( !runner.parseGrid( "topology=chain,tree,grid;transparentClock=1;users=" + sizeList ) ){
+      return 1;
+    }
+    std::map< std::string, std::vector< double > > baseline;
+    if( baselineFile != "" && !readResults( baselineFile, baseline ) ){
+      return 1;
+    }
+    runner.run( "" );
+
+    std::ofstream out( outputFile.c_str() );
+    out << "topology,users,ok,wall_time_s,events_per_s,packets_per_s,peak_rss_mb,receive_time_s\n";
+    std::cout << std::setw(8) << "Topology" << std::setw(8) << "Nodes" << std::setw(12) << "Wall(s)" << std::setw(14) << "Events/s"
+              << std::setw(14) << "Packets/s" << std::setw(12) << "PeakRSS(MB)" << std::setw(12) << "Receive(s)" << '\n';
+
+    int regressions = 0;
+    for( uint32_t index = 0; index < runner.getNumRuns(); index++ ){
+      std::string key = runner.getRunParameter( index, 0 ) + "," + runner.getRunParameter( index, 2 );
+      std::vector< double > result = resultOf( index );
+      bool ok = isComplete( index );
+      out << key << ',' << ok;
+      for( int m = 0; m < NUM_RESULTS; m++ ){
+        out << ',' << result[m];
+      }
+      out << '\n';
+
+      std::cout << std::setw(8) << runner.getRunParameter( index, 0 ) << std::setw(8) << runner.getRunParameter( index, 2 );
+      if( !ok ){
+        std::cout << "   FAILED" << '\n';
+      }else{
+        for( int m = 0; m < NUM_RESULTS; m++ ){
+          std::cout << std::setw( m == 0 ? 12 : ( m < 3 ? 14 : 12 ) ) << result[m];
+        }
+        std::cout << '\n';
+      }
+
+      if( baseline.count( key ) ){
+        regressions += compare( key, ok, result, baseline[key] );
+      }else if( baselineFile != "" ){
+        std::cerr << "REGRESSION " << key << ": not in " << baselineFile << std::endl;
+        regressions++;
+      }
+    }
+    std::cout.flush();
+
+    if( regressions > 0 ){
+      std::cerr << "benchmark: " << regressions << " regressions against " << baselineFile << std::endl;
+      return 2;
+    }
+    return 0;
+  }
+
+private:
+  enum RESULT{
+    RESULT_WALL_TIME,
+    RESULT_EVENT_RATE,
+    RESULT_PACKET_RATE,
+    RESULT_PEAK_RSS,
+    RESULT_RECEIVE_TIME,
+    NUM_RESULTS
+  };
+
+  // the scenario ran, sent every packet and synchronized every node
+  bool isComplete( uint32_t index ){
+    const ScenarioMetrics &metrics = runner.getRunMetrics( index );
+    return runner.isRunSucceeded( index ) && metrics.values[METRIC_SEND_FAILURES] == 0
+      && metrics.values[METRIC_SYNCED_FRACTION] == 1;
+  }
+
+  std::vector< double > resultOf( uint32_t index ){
+    const ScenarioMetrics &metrics = runner.getRunMetrics( index );
+    double wall = std::max( metrics.values[METRIC_WALL_TIME], 1e-9 );
+    std::vector< double > result( NUM_RESULTS );
+    result[RESULT_WALL_TIME] = metrics.values[METRIC_WALL_TIME];
+    result[RESULT_EVENT_RATE] = metrics.values[METRIC_EVENTS] / wall;
+    result[RESULT_PACKET_RATE] = ( metrics.values[METRIC_PACKETS_SENT] + metrics.values[METRIC_PACKETS_RECEIVED] ) / wall;
+    result[RESULT_PEAK_RSS] = metrics.values[METRIC_PEAK_RSS];
+    result[RESULT_RECEIVE_TIME] = metrics.values[METRIC_RECEIVE_TIME];
+    return result;
+  }
+
+  // baseline row: ok flag followed by the results
+  int compare( std::string key, bool ok, const std::vector< double > &result, const std::vector< double > &base ){
+    int regressions = 0;
+    if( base[0] && !ok ){
+      std::cerr << "REGRESSION " << key << ": run failed, it succeeded in the baseline" << std::endl;
+      return 1;
+    }
+    if( !base[0] || !ok ){
+      return 0;
+    }
+    // wall time and memory may grow, event and packet rates may drop, by at most maxRegression
+    if( result[RESULT_WALL_TIME] > base[1 + RESULT_WALL_TIME] * ( 1 + maxRegression ) ){
+      std::cerr << "REGRESSION " << key << ": wall time " << result[RESULT_WALL_TIME] << " s, baseline " << base[1 + RESULT_WALL_TIME] << " s" << std::endl;
+      regressions++;
+    }
+    if( result[RESULT_EVENT_RATE] < base[1 + RESULT_EVENT_RATE] * ( 1 - maxRegression ) ){
+      std::cerr << "REGRESSION " << key << ": " << result[RESULT_EVENT_RATE] << " events/s, baseline " << base[1 + RESULT_EVENT_RATE] << std::endl;
+      regressions++;
+    }
+    if( result[RESULT_PACKET_RATE] < base[1 + RESULT_PACKET_RATE] * ( 1 - maxRegression ) ){
+      std::cerr << "REGRESSION " << key << ": " << result[RESULT_PACKET_RATE] << " packets/s, baseline " << base[1 + RESULT_PACKET_RATE] << std::endl;
+      regressions++;
+    }
+    if( result[RESULT_PEAK_RSS] > base[1 + RESULT_PEAK_RSS] * ( 1 + maxRegression ) ){
+      std::cerr << "REGRESSION " << key << ": peak RSS " << result[RESULT_PEAK_RSS] << " MB, baseline " << base[1 + RESULT_PEAK_RSS] << " MB" << std::endl;
+      regressions++;
+    }
+    return regressions;
+  }
+
+  bool readResults( std::string fileName, std::map< std::string, std::vector< double > > &results ){
+    std::ifstream in( fileName.c_str() );
+    if( !in.is_open() ){
+      std::cerr << "cannot open benchmark baseline " << fileName << std::endl;
+      return false;
+    }
+    std::string line, item;
+    std::getline( in, line ); // header
+    while( std::getline( in, line ) ){
+      if( line.empty() || line[0] == '#' ){
+        continue;
+      }
+      std::stringstream lineStream( line );
+      std::string topology, users;
+      std::getline( lineStream, topology, ',' );
+      std::getline( lineStream, users, ',' );
+      std::vector< double > &row = results[ topology + "," + users ];
+      while( std::getline( lineStream, item, ',' ) ){
+        row.push_back( atof( item.c_str() ) );
+      }
+      if( row.size() < 1 + NUM_RESULTS ){
+        std::cerr << "malformed benchmark baseline line: " << line << std::endl;
+        return false;
+      }
+      // a point that ran must carry its measured timings, a placeholder would compare as a pass
+      if( row[0] && ( row[1 + RESULT_WALL_TIME] <= 0 || row[1 + RESULT_EVENT_RATE] <= 0
+                      || row[1 + RESULT_PACKET_RATE] <= 0 || row[1 + RESULT_PEAK_RSS] <= 0 ) ){
+        std::cerr << "benchmark baseline has no measured timings: " << line << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  SweepRunner runner;
+  std::string sizeList;
+  double maxRegression;
+};
+
+//-------------------------------------------------X--End of BenchmarkRunner Class--X------------------------------------------
+
+
+//-------------------------------------------------X--Start of Main function--X------------------------------------------
+
+int main (int argc, char *argv[])
+{
+  ScenarioConfig config;
+  std::string rebuildTrace ("");
+  std::string sweep ("");
+  uint32_t replications = 1;
+  uint32_t batch = 1;
+  uint32_t jobs = 0;
+  std::string sweepOutput ("ptp-sweep.csv");
+  bool benchmark = false;
+  std::string benchmarkSizes ("6,50,200,1000,5000");
+  std::string benchmarkOutput ("ptp-benchmark.csv");
+  std::string benchmarkBaseline ("");
+  double benchmarkTolerance = 0.2;
+
+  CommandLine cmd;
+
+  cmd.AddValue ("phyMode", "Wifi Phy mode", config.phyMode);
+  cmd.AddValue ("rss", "received signal strength", config.rss);
+  cmd.AddValue ("packetSize", "size of application packet sent", config.packetSize);
+  cmd.AddValue ("interval", "interval (nanoseconds) between packets", config.interval);
+  cmd.AddValue ("users", "Number of receivers", config.users);
+  cmd.AddValue ("topology", "Generated topology: chain, tree, grid or random (geometric)", config.topologyType);
+  cmd.AddValue ("topologyFile", "Load the topology from an edge list or adjacency list file instead", config.topologyFile);
+  cmd.AddValue ("treeFanout", "Children per node of the tree topology", config.treeFanout);
+  cmd.AddValue ("linkRange", "Link distance of the random topology in node spacings", config.linkRange);
+  cmd.AddValue ("lazyClocks", "Evaluate node clocks on demand instead of updating all nodes on every event", config.lazyClocks);
+  cmd.AddValue ("transparentClock", "Relays accumulate a constant-size correction instead of forwarding every hop's timestamps", config.transparentClock);
+  cmd.AddValue ("rightSizedFrames", "Send every message with its serialized size instead of padding it to packetSize", config.rightSizedFrames);
+  cmd.AddValue ("oneStep", "One-step clock: the SYNC carries its send time and no FOLLOW is sent", config.oneStep);
+  cmd.AddValue ("phyTimestamps", "Take timestamps at the start of the frame at the Wi-Fi PHY instead of in the application", config.phyTimestamps);
+  cmd.AddValue ("broadcast", "One socket per node, every message is broadcast once instead of unicast to each neighbour", config.broadcast);
+  cmd.AddValue ("slotted", "Run the exchanges of independent branches concurrently in TDMA slots from a distance-2 coloring", config.slotted);
+  cmd.AddValue ("slotLength", "Slot length (seconds) of the slotted mode, 0 to size it to the longest burst", config.slotLength);
+  cmd.AddValue ("maxRange", "Radio range in metres, 0 for no limit (every node hears every other)", config.maxRange);
+  cmd.AddValue ("statsInterval", "Interval (seconds) between convergence statistics checkpoints, 0 for the end of the run only", config.statsInterval);
+  cmd.AddValue ("statsFile", "CSV file of the statistics checkpoints, stdout if empty", config.statsFile);
+  cmd.AddValue ("syncRounds", "Number of synchronization rounds, more than one enables periodic sync with a PI servo", config.syncRounds);
+  cmd.AddValue ("syncInterval", "Interval (seconds) between synchronization rounds", config.syncInterval);
+  cmd.AddValue ("servoKp", "Proportional gain of the clock servo", config.servoKp);
+  cmd.AddValue ("servoKi", "Integral gain of the clock servo", config.servoKi);
+  cmd.AddValue ("oscillator", "Oscillator model: constant, randomwalk, temperature or allan", config.oscillator.model);
+  cmd.AddValue ("oscillatorStep", "Seconds the frequency of the oscillator models stays constant", config.oscillator.step);
+  cmd.AddValue ("walkPpb", "randomwalk: standard deviation (ppb) of the frequency change per step", config.oscillator.walkPpb);
+  cmd.AddValue ("temperatureSwing", "temperature: amplitude (C) of the temperature cycle around the crystal's turnover point", config.oscillator.temperatureSwing);
+  cmd.AddValue ("temperaturePeriod", "temperature: period (seconds) of the temperature cycle", config.oscillator.temperaturePeriod);
+  cmd.AddValue ("allanWhitePpb", "allan: Allan deviation (ppb) at tau = oscillatorStep of the white frequency noise", config.oscillator.allanWhitePpb);
+  cmd.AddValue ("allanWalkPpb", "allan: Allan deviation (ppb) at tau = oscillatorStep of the random walk frequency noise", config.oscillator.allanWalkPpb);
+  cmd.AddValue ("election", "Elect the grandmaster and build the sync tree at runtime with ANNOUNCE messages", config.election);
+  cmd.AddValue ("electionSlot", "Seconds between the self-announce turns of consecutive node ids, longer than an announce needs to flood the network", config.electionSlot);
+  cmd.AddValue ("electionTime", "Seconds from the start of the election to the start of the protocol", config.electionTime);
+  cmd.AddValue ("grandmasterCandidates", "Comma separated ids of the nodes with a better priority1 than the default", config.grandmasterCandidates);
+  cmd.AddValue ("masterFailTime", "Seconds at which the master fails, 0 for never; the nodes detect it and elect a backup", config.masterFailTime);
+  cmd.AddValue ("stallTimeout", "Seconds after which an exchange waiting for a lost broadcast frame or a failed node is given up, 0 for never", config.stallTimeout);
+  cmd.AddValue ("syncTimeout", "Sync intervals without a completed exchange before a node declares its master lost", config.syncTimeout);
+  cmd.AddValue ("mobility", "Node movement: static, waypoint (random waypoint) or trace (ns-2 movement file); needs broadcast and maxRange", config.mobility);
+  cmd.AddValue ("mobilityTrace", "ns-2 movement file of the trace mobility", config.mobilityTrace);
+  cmd.AddValue ("speed", "Top speed (m/s) of the random waypoint mobility", config.speed);
+  cmd.AddValue ("pause", "Seconds a node rests at every waypoint", config.pause);
+  cmd.AddValue ("helloInterval", "Seconds between the HELLOs of the neighbour discovery", config.helloInterval);
+  cmd.AddValue ("helloLoss", "HELLO intervals without one before a neighbour counts as lost", config.helloLoss);
+  cmd.AddValue ("saveSnapshot", "Write the converged state (clocks, servos, counters, topology, master) to this file at the end", config.saveSnapshot);
+  cmd.AddValue ("loadSnapshot", "Start from the state saved by saveSnapshot instead of unsynchronized clocks; replaces the topology", config.loadSnapshot);
+  cmd.AddValue ("capture", "Write pcap and NetAnim files", config.capture);
+  cmd.AddValue ("animation", "Write the NetAnim file when capturing", config.animation);
+  cmd.AddValue ("captureStart", "Seconds at which the capture window opens", config.captureStart);
+  cmd.AddValue ("captureStop", "Seconds at which the capture window closes, 0 for the end of the run", config.captureStop);
+  cmd.AddValue ("captureNodes", "Comma separated ids of the nodes whose frames are captured, empty for all", config.captureNodes);
+  cmd.AddValue ("captureTypes", "Comma separated message types to capture (Sync, Follow, Dreq, Drply, Announce, Hello), empty for all frames", config.captureTypes);
+  cmd.AddValue ("captureBuffer", "Keep the last frames in memory and write them only when a trigger fires, 0 to write every frame", config.captureBuffer);
+  cmd.AddValue ("captureTrigger", "Offset error (ns) before a correction that flushes the capture buffer, 0 for none", config.captureTrigger);
+  cmd.AddValue ("captureFlushAtEnd", "Also write the frames left in the capture buffer at the end of the run", config.captureFlushAtEnd);
+  cmd.AddValue ("traceLevel", "0 - off, 1 - events, 2 - events and changed nodes, 3 - also print the clock table", config.traceLevel);
+  cmd.AddValue ("traceFile", "File the clock trace is written to", config.traceFile);
+  cmd.AddValue ("seed", "Seed of the random number generators", config.seed);
+  cmd.AddValue ("run", "Run (substream) number of the random number generators", config.run);
+  cmd.AddValue ("rebuildTrace", "Print the full clock table from a trace file and exit", rebuildTrace);
+  cmd.AddValue ("sweep", "Parameter grid to sweep, e.g. \"users=6,20,50;rss=-93,-80\"", sweep);
+  cmd.AddValue ("replications", "Runs (seeds) per point of the sweep", replications);
+  cmd.AddValue ("jobs", "Concurrent sweep runs, 0 - one per core", jobs);
+  cmd.AddValue ("sweepOutput", "Aggregated sweep results; per-run results go to <name>.runs.csv", sweepOutput);
+  cmd.AddValue ("batch", "Run this many scenarios (runs run, run+1, ...) back to back in one process", batch);
+  cmd.AddValue ("benchmark", "Run the scaling benchmark on chain, tree and mesh topologies", benchmark);
+  cmd.AddValue ("benchmarkSizes", "Node counts of the benchmark", benchmarkSizes);
+  cmd.AddValue ("benchmarkOutput", "File the benchmark results are written to, usable as a baseline", benchmarkOutput);
+  cmd.AddValue ("benchmarkBaseline", "Earlier benchmark results to compare against, regressions make the run fail; empty for none", benchmarkBaseline);
+  cmd.AddValue ("benchmarkTolerance", "Relative slowdown or memory growth tolerated against the baseline", benchmarkTolerance);
+
+  cmd.Parse (argc, argv);
+
+  if( rebuildTrace != "" ){
+    return ClockTrace::rebuildTable( rebuildTrace, std::cout );
+  }
+
+  if( batch > 1 ){
+    return runBatch( config, batch );
+  }
+
+  if( benchmark ){
+    config.profile = true;
+    BenchmarkRunner runner( config, benchmarkSizes, benchmarkTolerance );
+    return runner.run( benchmarkOutput, benchmarkBaseline );
+  }
+
+  if( sweep != "" ){
+    SweepRunner runner( config, replications, jobs );
+    if( !runner.parseGrid( sweep ) ){
+      return 1;
+    }
+    return runner.run( sweepOutput );
+  }
+
+  ScenarioMetrics metrics;
+  return runScenario( config, metrics );
+}